@@ -0,0 +1,210 @@
+/*-----------------------------------------------------------------------------
+ * file:  arp_bench.c
+ *
+ * Description:
+ *
+ * Benchmark of ARP cache reads from several threads at once: the lock and
+ * allocation free sr_arpcache_lookup_mac() against the locked, copying
+ * sr_arpcache_lookup(), at 1, 2, 4 ... reader threads.  A writer thread
+ * keeps refreshing mappings throughout, so readers also pay for retries,
+ * and every MAC read is checked against the one its IP was given.
+ *
+ * usage: arp_bench [entries] [lookups per thread] [max threads]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+
+#include "sr_router.h"
+#include "sr_arpcache.h"
+
+#define DEFAULT_ENTRIES 10000
+#define DEFAULT_LOOKUPS 2000000
+#define DEFAULT_THREADS 8
+
+struct bench_reader
+{
+    pthread_t thread;
+    int       lockfree;
+    uint32_t  seed;
+    long      bad;
+};
+
+static struct sr_arpcache bench_cache;
+static uint32_t bench_entries;
+static long bench_lookups;
+static volatile int bench_stop;
+
+/* -- sr_arpcache.c sends ARP requests, nothing is sent here -- */
+int sr_send_packet_id(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                      int id)
+{
+    (void)sr;
+    (void)buf;
+    (void)len;
+    (void)id;
+    return 0;
+}
+
+struct sr_if* sr_get_interface_id(struct sr_instance* sr, int id)
+{
+    (void)sr;
+    (void)id;
+    return 0;
+}
+
+static uint32_t bench_rand(uint32_t* seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -- the MAC of an address is derived from it, so readers can check it -- */
+static uint32_t bench_ip(uint32_t i) { return htonl(0x0a000000 + i); }
+
+static void bench_mac(uint32_t ip, unsigned char* mac)
+{
+    memcpy(mac, &ip, 4);
+    mac[4] = 0x02;
+    mac[5] = 0x5a;
+}
+
+static void* bench_read(void* arg)
+{
+    struct bench_reader* r = (struct bench_reader*)arg;
+    struct sr_arpentry* entry = 0;
+    unsigned char mac[6], want[6];
+    uint32_t ip;
+    long i;
+
+    for(i = 0; i < bench_lookups; i++)
+    {
+        ip = bench_ip(bench_rand(&r->seed) % bench_entries);
+        bench_mac(ip, want);
+        if(r->lockfree)
+        {
+            if(!sr_arpcache_lookup_mac(&bench_cache, ip, mac) ||
+               memcmp(mac, want, 6) != 0)
+            { r->bad++; }
+        }
+        else
+        {
+            entry = sr_arpcache_lookup(&bench_cache, ip);
+            if(entry == 0 || memcmp(entry->mac, want, 6) != 0)
+            { r->bad++; }
+            free(entry);
+        }
+    }
+
+    return 0;
+}
+
+static void* bench_write(void* arg)
+{
+    unsigned char mac[6];
+    uint32_t seed = 4242;
+    uint32_t ip;
+
+    (void)arg;
+    while(!bench_stop)
+    {
+        ip = bench_ip(bench_rand(&seed) % bench_entries);
+        bench_mac(ip, mac);
+        sr_arpcache_insert(&bench_cache, mac, ip, SR_IF_NONE);
+    }
+
+    return 0;
+}
+
+static void bench_run(int nthreads, int lockfree)
+{
+    struct bench_reader* readers = calloc(nthreads, sizeof(*readers));
+    pthread_t writer;
+    double t0, t1;
+    long bad = 0;
+    int i;
+
+    bench_stop = 0;
+    pthread_create(&writer, 0, bench_write, 0);
+
+    t0 = bench_now();
+    for(i = 0; i < nthreads; i++)
+    {
+        readers[i].lockfree = lockfree;
+        readers[i].seed = 12345 + i * 7919;
+        pthread_create(&readers[i].thread, 0, bench_read, &readers[i]);
+    }
+    for(i = 0; i < nthreads; i++)
+    {
+        pthread_join(readers[i].thread, 0);
+        bad += readers[i].bad;
+    }
+    t1 = bench_now();
+
+    bench_stop = 1;
+    pthread_join(writer, 0);
+
+    printf("  %-9s %2d threads: %7.2f Mlookups/s total, %6.1f ns/lookup/thread",
+           lockfree ? "lock free" : "locked", nthreads,
+           nthreads * bench_lookups / (t1 - t0) / 1e6,
+           (t1 - t0) * 1e9 / bench_lookups);
+    if(bad)
+    { printf("  *warning* %ld bad reads", bad); }
+    printf("\n");
+
+    free(readers);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned char mac[6];
+    int max_threads;
+    uint32_t i, ip;
+    int n;
+
+    bench_entries = argc > 1 ? atoi(argv[1]) : DEFAULT_ENTRIES;
+    bench_lookups = argc > 2 ? atol(argv[2]) : DEFAULT_LOOKUPS;
+    max_threads   = argc > 3 ? atoi(argv[3]) : DEFAULT_THREADS;
+    if(bench_entries == 0 || bench_lookups <= 0 || max_threads <= 0 ||
+       max_threads >= SR_EPOCH_MAX_THREADS)
+    {
+        fprintf(stderr, "usage: %s [entries] [lookups per thread] "
+                "[max threads]\n", argv[0]);
+        return 1;
+    }
+
+    sr_arpcache_init(&bench_cache);
+    sr_arpcache_set_max(&bench_cache, bench_entries);
+    for(i = 0; i < bench_entries; i++)
+    {
+        ip = bench_ip(i);
+        bench_mac(ip, mac);
+        sr_arpcache_insert(&bench_cache, mac, ip, SR_IF_NONE);
+    }
+
+    printf("%u entries, %ld lookups per thread, writer running\n",
+           bench_entries, bench_lookups);
+    for(n = 1; n <= max_threads; n *= 2)
+    {
+        bench_run(n, 1);
+        bench_run(n, 0);
+    }
+
+    sr_arpcache_destroy(&bench_cache);
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*-----------------------------------------------------------------------------
+ * file:  fib_bench.c
+ *
+ * Description:
+ *
+ * Microbenchmark of FIB lookups: one sr_fib_find() per packet against
+ * sr_fib_find_bulk() on bursts, for both engines, over a synthetic table
+ * shaped roughly like a full internet table (mostly /24s, a spread of
+ * shorter prefixes and a few longer ones).
+ *
+ * usage: fib_bench [routes] [lookups] [burst]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_fib.h"
+
+#define DEFAULT_ROUTES  1000000
+#define DEFAULT_LOOKUPS 8000000
+#define DEFAULT_BURST   32
+#define BENCH_GATEWAYS  64 /* peers the routes are spread over */
+
+static uint32_t bench_seed = 12345;
+
+static uint32_t bench_rand(void)
+{
+    /* -- xorshift32, so runs are repeatable across libcs -- */
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed;
+}
+
+static int bench_prefix_len(void)
+{
+    uint32_t r = bench_rand() % 100;
+
+    if(r < 55) { return 24; }
+    if(r < 75) { return 20 + bench_rand() % 4; }
+    if(r < 92) { return 16 + bench_rand() % 4; }
+    if(r < 97) { return 8 + bench_rand() % 8; }
+    return 25 + bench_rand() % 8;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_engine(int engine, const struct sr_rt* routes, int nroutes,
+                         const uint32_t* dst, int nlookups, int burst)
+{
+    struct sr_fib* fib = sr_fib_create(engine);
+    struct sr_fib_nh** out = 0;
+    unsigned long check_single = 0, check_bulk = 0;
+    double t0, t1, t2;
+    int i;
+
+    if(fib == 0 || (out = malloc(burst * sizeof(struct sr_fib_nh*))) == 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    t0 = bench_now();
+    for(i = 0; i < nroutes; i++)
+    {
+        if(sr_fib_insert(fib, &routes[i]) != 0)
+        {
+            fprintf(stderr, "insert failed at route %d\n", i);
+            exit(1);
+        }
+    }
+    fib->build_usec = (long)((bench_now() - t0) * 1e6);
+    sr_fib_report(fib);
+
+    t0 = bench_now();
+    for(i = 0; i < nlookups; i++)
+    {
+        struct sr_fib_nh* nh = sr_fib_find(fib, dst[i]);
+        check_single += nh ? (unsigned long)(nh - fib->nhs) + 1 : 0;
+    }
+    t1 = bench_now();
+    for(i = 0; i + burst <= nlookups; i += burst)
+    {
+        int j;
+        sr_fib_find_bulk(fib, dst + i, burst, out);
+        for(j = 0; j < burst; j++)
+        { check_bulk += out[j] ? (unsigned long)(out[j] - fib->nhs) + 1 : 0; }
+    }
+    for(; i < nlookups; i++)
+    {
+        struct sr_fib_nh* nh = sr_fib_find(fib, dst[i]);
+        check_bulk += nh ? (unsigned long)(nh - fib->nhs) + 1 : 0;
+    }
+    t2 = bench_now();
+
+    printf("  per-packet: %6.1f ns/lookup  %6.2f Mlookups/s\n",
+           (t1 - t0) * 1e9 / nlookups, nlookups / (t1 - t0) / 1e6);
+    printf("  bulk (%3d): %6.1f ns/lookup  %6.2f Mlookups/s\n", burst,
+           (t2 - t1) * 1e9 / nlookups, nlookups / (t2 - t1) / 1e6);
+    if(check_single != check_bulk)
+    { printf("  *warning* bulk and per-packet results differ\n"); }
+
+    free(out);
+    sr_fib_destroy(fib);
+}
+
+int main(int argc, char** argv)
+{
+    int nroutes  = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUTES;
+    int nlookups = argc > 2 ? atoi(argv[2]) : DEFAULT_LOOKUPS;
+    int burst    = argc > 3 ? atoi(argv[3]) : DEFAULT_BURST;
+    struct sr_rt* routes = 0;
+    uint32_t* dst = 0;
+    int i, len;
+
+    if(nroutes <= 0 || nlookups <= 0 || burst <= 0)
+    {
+        fprintf(stderr, "usage: %s [routes] [lookups] [burst]\n", argv[0]);
+        return 1;
+    }
+
+    routes = calloc(nroutes, sizeof(struct sr_rt));
+    dst = malloc(nlookups * sizeof(uint32_t));
+    if(routes == 0 || dst == 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for(i = 0; i < nroutes; i++)
+    {
+        len = bench_prefix_len();
+        routes[i].dest.s_addr = htonl(bench_rand());
+        routes[i].mask.s_addr = htonl(0xffffffffu << (32 - len));
+        routes[i].gw.s_addr   = htonl(0x0a000001 +
+                                      bench_rand() % BENCH_GATEWAYS);
+        snprintf(routes[i].interface, sr_IFACE_NAMELEN, "eth%d", i % 4);
+    }
+
+    /* -- half the traffic goes to covered prefixes, half anywhere -- */
+    for(i = 0; i < nlookups; i++)
+    {
+        if(i & 1)
+        { dst[i] = htonl(bench_rand()); }
+        else
+        {
+            dst[i] = htonl(ntohl(routes[bench_rand() % nroutes].dest.s_addr) ^
+                           (bench_rand() & 0xff));
+        }
+    }
+
+    printf("%d routes, %d lookups\n", nroutes, nlookups);
+    printf("trie:\n");
+    bench_engine(SR_FIB_TRIE, routes, nroutes, dst, nlookups, burst);
+    printf("dir24:\n");
+    bench_engine(SR_FIB_DIR24, routes, nroutes, dst, nlookups, burst);
+
+    free(routes);
+    free(dst);
+    return 0;
+}
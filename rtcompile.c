@@ -0,0 +1,73 @@
+/*-----------------------------------------------------------------------------
+ * file:  rtcompile.c
+ *
+ * Description:
+ *
+ * Offline routing table compiler.  Reads a text routing table (the format
+ * sr loads with -r), builds its FIB and writes it as a binary image.
+ * Giving sr the image instead of the text file skips parsing and building
+ * altogether: the image is mapped as is (see sr_fib_map), so even a full
+ * internet table is ready to forward as soon as it is mapped.
+ *
+ * usage: rtcompile [-F trie|dir24] rtable image
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sr_rt.h"
+#include "sr_fib.h"
+
+static void usage(char* argv0)
+{
+    fprintf(stderr, "usage: %s [-F trie|dir24] rtable image\n", argv0);
+}
+
+int main(int argc, char** argv)
+{
+    struct sr_rt_table* table = 0;
+    int engine = SR_FIB_TRIE;
+    int c;
+
+    while((c = getopt(argc, argv, "hF:")) != EOF)
+    {
+        switch(c)
+        {
+            case 'F':
+                if((engine = sr_fib_engine_parse(optarg)) < 0)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(argc - optind != 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if((table = sr_rt_table_load(argv[optind], engine)) == 0)
+    {
+        fprintf(stderr, "Error loading routing table from %s\n", argv[optind]);
+        return 1;
+    }
+    sr_fib_report(table->fib);
+
+    if(sr_fib_save(table->fib, argv[optind + 1]) != 0)
+    {
+        sr_rt_table_destroy(table);
+        return 1;
+    }
+    printf("Wrote %s\n", argv[optind + 1]);
+
+    sr_rt_table_destroy(table);
+    return 0;
+}
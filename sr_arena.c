@@ -0,0 +1,402 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_arena.c
+ *
+ * Description:
+ *
+ * Hugepage backed memory for the big tables and pools (see sr_arena.h)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+
+#include "sr_arena.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define SR_ARENA_THP_SYSFS "/sys/kernel/mm/transparent_hugepage/enabled"
+
+/* ----------------------------------------------------------------------------
+ * struct sr_arena_region
+ *
+ * One live allocation, in the order they were made
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_arena_region
+{
+    void* addr;
+    size_t size;          /* as mapped, whole hugepages unless on the heap */
+    int backing;          /* SR_ARENA_HEAP .. SR_ARENA_HUGETLB */
+    const char* owner;    /* e.g. "FIB" */
+    const char* name;     /* e.g. "tbl24" */
+    struct sr_arena_region* next;
+};
+
+static const char* sr_arena_backing_names[] =
+{ "heap", "pages", "THP", "hugetlb" };
+
+static const char* sr_arena_mode_names[] = { "auto", "thp", "off" };
+
+static pthread_mutex_t sr_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sr_arena_region* sr_arena_regions = 0;
+static int sr_arena_cur_mode = SR_ARENA_AUTO;
+static int sr_arena_thp = -1; /* -- transparent hugepages usable, -1 unknown -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_mode(..)
+ * Scope: Global
+ *
+ * Sets where later allocations may go, one of SR_ARENA_AUTO, _THP, _OFF
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_arena_mode(int mode)
+{
+    assert(mode >= SR_ARENA_AUTO && mode <= SR_ARENA_OFF);
+
+    sr_arena_cur_mode = mode;
+} /* -- sr_arena_mode -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_parse_mode(..)
+ * Scope: Global
+ *
+ * The mode called name ("auto", "thp" or "off"), -1 if there is none
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_arena_parse_mode(const char* name)
+{
+    int i;
+
+    for(i = SR_ARENA_AUTO; i <= SR_ARENA_OFF; i++)
+    {
+        if(strcmp(name, sr_arena_mode_names[i]) == 0)
+        { return i; }
+    }
+    return -1;
+} /* -- sr_arena_parse_mode -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_thp_usable(..)
+ * Scope: Local
+ *
+ * Whether the kernel does transparent hugepages for madvise()'d memory,
+ * i.e. they are there and not set to "never".  Caller holds the lock.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_arena_thp_usable(void)
+{
+    char line[128];
+    FILE* fp;
+
+    if(sr_arena_thp >= 0)
+    { return sr_arena_thp; }
+
+    sr_arena_thp = 0;
+#ifdef MADV_HUGEPAGE
+    if((fp = fopen(SR_ARENA_THP_SYSFS, "r")) != 0)
+    {
+        if(fgets(line, sizeof(line), fp) != 0 &&
+           strstr(line, "[never]") == 0)
+        { sr_arena_thp = 1; }
+        fclose(fp);
+    }
+#endif
+
+    return sr_arena_thp;
+} /* -- sr_arena_thp_usable -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_map(..)
+ * Scope: Local
+ *
+ * Maps len bytes (whole hugepages) of zeroed memory, on hugetlb pages if
+ * the mode and the reserved pool allow, else hugepage aligned for THP
+ * unless the mode is off.  Sets backing to what it got.  0 if the
+ * mapping failed.
+ *
+ *---------------------------------------------------------------------*/
+
+static void* sr_arena_map(size_t len, int* backing)
+{
+    uint8_t* raw;
+    uint8_t* p;
+    size_t head;
+    int thp;
+
+#ifdef MAP_HUGETLB
+    if(sr_arena_cur_mode == SR_ARENA_AUTO)
+    {
+        p = (uint8_t*)mmap(0, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(p != (uint8_t*)MAP_FAILED)
+        {
+            *backing = SR_ARENA_HUGETLB;
+            return p;
+        }
+    }
+#endif
+
+    /* -- a hugepage more than needed, trimmed to hugepage alignment -- */
+    raw = (uint8_t*)mmap(0, len + SR_ARENA_HUGEPAGE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == (uint8_t*)MAP_FAILED)
+    { return 0; }
+
+    p = (uint8_t*)(((uintptr_t)raw + SR_ARENA_HUGEPAGE - 1) &
+                   ~(uintptr_t)(SR_ARENA_HUGEPAGE - 1));
+    head = p - raw;
+    if(head)
+    { munmap(raw, head); }
+    if(SR_ARENA_HUGEPAGE - head)
+    { munmap(p + len, SR_ARENA_HUGEPAGE - head); }
+
+    *backing = SR_ARENA_PAGES;
+    if(sr_arena_cur_mode == SR_ARENA_OFF)
+    { return p; }
+
+    pthread_mutex_lock(&sr_arena_lock);
+    thp = sr_arena_thp_usable();
+    pthread_mutex_unlock(&sr_arena_lock);
+#ifdef MADV_HUGEPAGE
+    if(thp && madvise(p, len, MADV_HUGEPAGE) == 0)
+    { *backing = SR_ARENA_THPAGES; }
+#endif
+
+    return p;
+} /* -- sr_arena_map -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_alloc(..)
+ * Scope: Global
+ *
+ * At least *size bytes of zeroed memory for the structure called name
+ * of owner, both of which must stay valid while it is allocated.  *size
+ * is set to what was actually allocated, which the caller may use all
+ * of.  0 if out of memory.
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_arena_alloc(size_t* size, const char* owner, const char* name)
+{
+    struct sr_arena_region* r = 0;
+    struct sr_arena_region** link = 0;
+    size_t len;
+    void* p = 0;
+
+    assert(size);
+
+    r = (struct sr_arena_region*)malloc(sizeof(struct sr_arena_region));
+    if(r == 0)
+    { return 0; }
+
+    if(*size >= SR_ARENA_MIN)
+    {
+        /* -- mapped even without hugepages, so it is zeroed lazily -- */
+        len = (*size + SR_ARENA_HUGEPAGE - 1) &
+            ~(size_t)(SR_ARENA_HUGEPAGE - 1);
+        if((p = sr_arena_map(len, &(r->backing))) == 0)
+        {
+            free(r);
+            return 0;
+        }
+        *size = len;
+    }
+    else
+    {
+        r->backing = SR_ARENA_HEAP;
+        if(posix_memalign(&p, SR_ARENA_ALIGN, *size ? *size : 1) != 0)
+        {
+            free(r);
+            return 0;
+        }
+        memset(p, 0, *size);
+    }
+
+    r->addr = p;
+    r->size = *size;
+    r->owner = owner;
+    r->name = name;
+    r->next = 0;
+
+    pthread_mutex_lock(&sr_arena_lock);
+    for(link = &sr_arena_regions; *link; link = &((*link)->next));
+    *link = r;
+    pthread_mutex_unlock(&sr_arena_lock);
+
+    return p;
+} /* -- sr_arena_alloc -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_realloc(..)
+ * Scope: Global
+ *
+ * Moves the old bytes at p (which may be 0) into a new allocation of
+ * size bytes, the rest of it zeroed.  p is left alone if that fails.
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_arena_realloc(void* p, size_t old, size_t size,
+                       const char* owner, const char* name)
+{
+    size_t len = size;
+    void* q = sr_arena_alloc(&len, owner, name);
+
+    if(q == 0)
+    { return 0; }
+
+    if(p)
+    {
+        memcpy(q, p, old < size ? old : size);
+        sr_arena_free(p);
+    }
+    return q;
+} /* -- sr_arena_realloc -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_free(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_arena_free(void* p)
+{
+    struct sr_arena_region** link = 0;
+    struct sr_arena_region* r = 0;
+
+    if(p == 0)
+    { return; }
+
+    pthread_mutex_lock(&sr_arena_lock);
+    for(link = &sr_arena_regions; *link && (*link)->addr != p;
+        link = &((*link)->next));
+    if((r = *link) != 0)
+    { *link = r->next; }
+    pthread_mutex_unlock(&sr_arena_lock);
+
+    assert(r);
+    if(r == 0)
+    { return; }
+
+    if(r->backing == SR_ARENA_HEAP)
+    { free(r->addr); }
+    else
+    { munmap(r->addr, r->size); }
+    free(r);
+} /* -- sr_arena_free -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_huge_bytes(..)
+ * Scope: Local
+ *
+ * Bytes of [addr, addr + len) that are on transparent hugepages right
+ * now, by /proc/self/smaps.  A mapping the kernel merged with a
+ * neighbor is counted in proportion to the overlap.
+ *
+ *---------------------------------------------------------------------*/
+
+static size_t sr_arena_huge_bytes(void* addr, size_t len)
+{
+    unsigned long start = 0, end = 0, lo, hi, kb;
+    uintptr_t a = (uintptr_t)addr;
+    size_t bytes = 0;
+    char line[256];
+    FILE* fp;
+
+    if((fp = fopen("/proc/self/smaps", "r")) == 0)
+    { return 0; }
+
+    while(fgets(line, sizeof(line), fp) != 0)
+    {
+        if(sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+        {
+            start = lo;
+            end = hi;
+        }
+        else if(sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 && kb &&
+                end > a && start < a + len)
+        {
+            lo = start > a ? start : a;
+            hi = end < a + len ? end : a + len;
+            bytes += (size_t)((double)kb * 1024 * (hi - lo) / (end - start));
+        }
+    }
+
+    fclose(fp);
+    return bytes;
+} /* -- sr_arena_huge_bytes -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_arena_report(..)
+ * Scope: Global
+ *
+ * Print, for each structure, how much memory it has of each kind and
+ * how much of its THP memory the kernel has put on hugepages so far
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_arena_report(void)
+{
+    struct sr_arena_region* r = 0;
+    struct sr_arena_region* s = 0;
+    size_t bytes[SR_ARENA_HUGETLB + 1];
+    size_t huge;
+    int i;
+
+    pthread_mutex_lock(&sr_arena_lock);
+
+    printf("Memory arenas: hugepages %s, transparent hugepages %s\n",
+           sr_arena_mode_names[sr_arena_cur_mode],
+           sr_arena_thp_usable() ? "usable" : "unavailable");
+
+    for(r = sr_arena_regions; r; r = r->next)
+    {
+        /* -- one line per structure, where it first shows up -- */
+        for(s = sr_arena_regions; s != r; s = s->next)
+        {
+            if(strcmp(s->owner, r->owner) == 0 && strcmp(s->name, r->name) == 0)
+            { break; }
+        }
+        if(s != r)
+        { continue; }
+
+        memset(bytes, 0, sizeof(bytes));
+        huge = 0;
+        for(; s; s = s->next)
+        {
+            if(strcmp(s->owner, r->owner) != 0 || strcmp(s->name, r->name) != 0)
+            { continue; }
+            bytes[s->backing] += s->size;
+            if(s->backing == SR_ARENA_THPAGES)
+            { huge += sr_arena_huge_bytes(s->addr, s->size); }
+            else if(s->backing == SR_ARENA_HUGETLB)
+            { huge += s->size; }
+        }
+
+        printf("  %s %s:", r->owner, r->name);
+        for(i = SR_ARENA_HUGETLB; i >= SR_ARENA_HEAP; i--)
+        {
+            if(bytes[i])
+            {
+                printf(" %lu kB %s", (unsigned long)(bytes[i] / 1024),
+                       sr_arena_backing_names[i]);
+            }
+        }
+        if(bytes[SR_ARENA_HEAP] == 0)
+        { printf(", %lu kB on hugepages", (unsigned long)(huge / 1024)); }
+        printf("\n");
+    }
+
+    pthread_mutex_unlock(&sr_arena_lock);
+} /* -- sr_arena_report -- */
@@ -0,0 +1,64 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_arena.h
+ *
+ * Description:
+ *
+ * Memory for the router's big, long lived structures (the compiled FIB,
+ * the ARP table, the slabs of the buffer pools), on 2MB hugepages where
+ * the machine has them.  A lookup that walks a 64MB DIR-24-8 table or a
+ * large neighbor table on 4KB pages misses the TLB more often than it
+ * misses the cache.
+ *
+ * An allocation of SR_ARENA_MIN bytes or more is rounded up to whole
+ * hugepages and gets a mapping of its own, tried in this order:
+ *
+ *   hugetlb  - MAP_HUGETLB, from the pool the administrator reserved in
+ *              /proc/sys/vm/nr_hugepages (only in SR_ARENA_AUTO mode)
+ *   THP      - anonymous memory aligned to SR_ARENA_HUGEPAGE and
+ *              madvise(MADV_HUGEPAGE)'d, unless transparent hugepages
+ *              are set to "never"; the kernel backs it with hugepages as
+ *              it is touched, if it can find them
+ *   pages    - the same mapping on ordinary pages, which is all there
+ *              is in SR_ARENA_OFF mode
+ *
+ * Anything smaller comes from the heap.  Memory is zeroed and aligned to
+ * at least a cache line either way, and untouched parts of a mapping
+ * cost nothing until written, in hugepage sized pieces for THP.
+ *
+ * Every allocation is recorded under the structure it belongs to, which
+ * is what sr_arena_report() prints: where each structure landed and how
+ * big it is, with the part the kernel has actually put on hugepages.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_ARENA_H
+#define sr_ARENA_H
+
+#include <stddef.h>
+
+#define SR_ARENA_HUGEPAGE (2 * 1024 * 1024)
+#define SR_ARENA_MIN      (SR_ARENA_HUGEPAGE / 2) /* smaller goes on the heap */
+#define SR_ARENA_ALIGN    64                      /* of heap allocations */
+
+/* -- modes -- */
+#define SR_ARENA_AUTO 0  /* hugetlb, else THP */
+#define SR_ARENA_THP  1  /* THP only */
+#define SR_ARENA_OFF  2  /* no hugepages */
+
+/* -- where an allocation landed -- */
+#define SR_ARENA_HEAP    0
+#define SR_ARENA_PAGES   1
+#define SR_ARENA_THPAGES 2
+#define SR_ARENA_HUGETLB 3
+
+void  sr_arena_mode(int mode);
+int   sr_arena_parse_mode(const char* name);
+
+void* sr_arena_alloc(size_t* size, const char* owner, const char* name);
+void* sr_arena_realloc(void* p, size_t old, size_t size,
+                       const char* owner, const char* name);
+void  sr_arena_free(void* p);
+
+void  sr_arena_report(void);
+
+#endif  /* --  sr_ARENA_H -- */
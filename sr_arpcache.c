@@ -1,4 +1,5 @@
 #include <netinet/in.h>
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -10,42 +11,503 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_arena.h"
+
+/* Bytes of budget a queued packet takes, the buffer it's kept in */
+#define SR_ARPQ_CHARGE SR_MBUF_FRAME
+
+/* Hash of an IP for the mapping table and the request buckets. Addresses
+   on one subnet differ in their last octets, so mix every bit in before
+   masking. */
+static uint32_t sr_arpcache_hash(uint32_t ip) {
+    ip ^= ip >> 16;
+    ip *= 0x45d9f3b;
+    ip ^= ip >> 16;
+    return ip;
+}
+
+/* Home slot of an IP in the hash table. */
+static uint32_t sr_arpcache_home(struct sr_arptable *table, uint32_t ip) {
+    return sr_arpcache_hash(ip) & (table->size - 1);
+}
+
+/* Returns the link that points at ip's pending request, or at the NULL
+   ending its bucket if there is none. Caller holds the lock. */
+static struct sr_arpreq **sr_arpreq_link(struct sr_arpcache *cache,
+                                         uint32_t ip)
+{
+    struct sr_arpreq **link;
+
+    link = &(cache->reqs[sr_arpcache_hash(ip) & (cache->reqs_size - 1)]);
+    while (*link && (*link)->ip != ip)
+        link = &((*link)->next);
+
+    return link;
+}
+
+/* Doubles the request buckets. Requests stay where they are if there's no
+   memory for more; chains just get longer. Caller holds the lock. */
+static void sr_arpreq_grow(struct sr_arpcache *cache) {
+    uint32_t size = cache->reqs_size * 2;
+    struct sr_arpreq **reqs, *req, *next;
+    uint32_t i, j;
+
+    reqs = (struct sr_arpreq **)calloc(size, sizeof(struct sr_arpreq *));
+    if (!reqs)
+        return;
+
+    for (i = 0; i < cache->reqs_size; i++) {
+        for (req = cache->reqs[i]; req; req = next) {
+            next = req->next;
+            j = sr_arpcache_hash(req->ip) & (size - 1);
+            req->next = reqs[j];
+            reqs[j] = req;
+        }
+    }
+
+    free(cache->reqs);
+    cache->reqs = reqs;
+    cache->reqs_size = size;
+}
+
+/* Frees a packet that was queued on a request. Caller holds the lock. */
+static void sr_packet_free(struct sr_arpcache *cache, struct sr_packet *pkt) {
+    cache->queued_bytes -= SR_ARPQ_CHARGE;
+    sr_mbuf_put(pkt->mbuf);
+    sr_pool_free(pkt);
+}
+
+/* Drops the oldest packet queued on req. Caller holds the lock. */
+static void sr_arpreq_drop_oldest(struct sr_arpcache *cache,
+                                  struct sr_arpreq *req)
+{
+    struct sr_packet *pkt = req->packets;
+
+    req->packets = pkt->next;
+    if (!req->packets)
+        req->last = NULL;
+    req->npackets--;
+    sr_packet_free(cache, pkt);
+}
+
+/* Writers bracket every change to the table with these, making seq odd
+   while the change is under way (see sr_arpcache_lookup_mac). Caller
+   holds the lock. */
+static void sr_arpcache_write_begin(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sr_arpcache_write_end(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Schedules a timer on the cache's wheel, waking the cleanup thread if it
+   is asleep past the new time. Caller holds the lock. */
+static void sr_arpcache_schedule(struct sr_arpcache *cache,
+                                 struct sr_timer *timer, uint64_t expires)
+{
+    sr_timer_add(&(cache->timers), timer, expires);
+    if (expires < cache->wake)
+        pthread_cond_signal(&(cache->cond));
+}
+
+/* Returns the entry for ip, or NULL. Caller holds the lock. */
+static struct sr_arpentry *sr_arpcache_find(struct sr_arpcache *cache,
+                                            uint32_t ip)
+{
+    struct sr_arptable *t = cache->table;
+    uint32_t i = sr_arpcache_home(t, ip);
+
+    while (t->entries[i].valid) {
+        if (t->entries[i].ip == ip)
+            return &(t->entries[i]);
+        i = (i + 1) & (t->size - 1);
+    }
+
+    return NULL;
+}
+
+/* Rehashes every entry into a new table of size slots and swaps it in.
+   Lock free readers may still be probing the old table, so it is only
+   freed once they are all done with it. Returns 0 on success. Caller
+   holds the lock. */
+static int sr_arpcache_resize(struct sr_arpcache *cache, uint32_t size) {
+    struct sr_arptable *old = cache->table;
+    struct sr_arptable *t;
+    size_t len;
+    uint32_t i, j;
+
+    t = (struct sr_arptable *)malloc(sizeof(struct sr_arptable));
+    if (!t)
+        return -1;
+    t->size = size;
+    len = size * sizeof(struct sr_arpentry);
+    t->entries = (struct sr_arpentry *)sr_arena_alloc(&len, "ARP", "table");
+    if (!t->entries) {
+        free(t);
+        return -1;
+    }
+
+    for (i = 0; i < old->size; i++) {
+        if (!old->entries[i].valid)
+            continue;
+        j = sr_arpcache_home(t, old->entries[i].ip);
+        while (t->entries[j].valid)
+            j = (j + 1) & (size - 1);
+        t->entries[j] = old->entries[i];
+    }
+
+    __atomic_store_n(&(cache->table), t, __ATOMIC_RELEASE);
+    cache->hand = 0;
+
+    sr_epoch_synchronize(&(cache->epoch));
+    sr_arena_free(old->entries);
+    free(old);
+    return 0;
+}
+
+/* Removes the entry in slot i. Later entries of the same probe run are
+   shifted back into the hole, so lookups never need tombstones. Caller
+   holds the lock and is inside a write section. */
+static void sr_arpcache_remove(struct sr_arpcache *cache, uint32_t i) {
+    struct sr_arptable *t = cache->table;
+    uint32_t mask = t->size - 1;
+    uint32_t j = i, home;
+
+    if (t->entries[i].expiry) {
+        sr_timer_del(&(cache->timers), &(t->entries[i].expiry->timer));
+        sr_pool_free(t->entries[i].expiry);
+        t->entries[i].expiry = NULL;
+    }
+    t->entries[i].valid = 0;
+    cache->count--;
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!t->entries[j].valid)
+            return;
+
+        /* Entry j may only move back if its home isn't in (i, j] */
+        home = sr_arpcache_home(t, t->entries[j].ip);
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        t->entries[i] = t->entries[j];
+        t->entries[j].valid = 0;
+        i = j;
+    }
+}
+
+/* Evicts one entry using the CLOCK algorithm: the hand skips (and clears)
+   entries used since it last passed them, and takes the first one that
+   wasn't. Caller holds the lock, is inside a write section, and the cache
+   isn't empty. */
+static void sr_arpcache_evict(struct sr_arpcache *cache) {
+    struct sr_arptable *t = cache->table;
+    struct sr_arpentry *entry;
+
+    for (;;) {
+        cache->hand &= t->size - 1;
+        entry = &(t->entries[cache->hand]);
+        if (entry->valid) {
+            if (!__atomic_load_n(&(entry->referenced), __ATOMIC_RELAXED))
+                break;
+            __atomic_store_n(&(entry->referenced), 0, __ATOMIC_RELAXED);
+        }
+        cache->hand++;
+    }
+
+    sr_arpcache_remove(cache, cache->hand);
+    cache->evictions++;
+    __atomic_add_fetch(&(cache->gen), 1, __ATOMIC_RELEASE);
+}
+
+/* Takes a token from the interface's ARP request bucket, topping it up
+   for the time since it last was. Returns 0 if there was one. Caller holds
+   the lock. */
+static int sr_arpcache_take_token(struct sr_if *iface) {
+    uint64_t now = sr_timer_now_ms();
+    uint64_t tokens;
+
+    tokens = iface->arp_tokens + (now - iface->arp_refill) * SR_ARP_RATE;
+    if (tokens > SR_ARP_BURST * 1000)
+        tokens = SR_ARP_BURST * 1000;
+    iface->arp_refill = now;
+
+    if (tokens < 1000) {
+        iface->arp_tokens = tokens;
+        return -1;
+    }
+    iface->arp_tokens = tokens - 1000;
+    return 0;
+}
+
+/* Makes an ARP request for ip out of interface ifid, to dst or to
+   everyone if dst is NULL, and puts it in the outbox for
+   sr_arpcache_send_outbox. Returns 0 if it will be sent, 1 if the
+   interface's rate limit (or a full outbox) held it back, -1 if there is
+   no such interface. Caller holds the lock. */
+static int sr_arpcache_send_request(struct sr_instance *sr, int ifid,
+                                    uint32_t ip, const unsigned char *dst)
+{
+    struct sr_arpcache *cache = &(sr->cache);
+    struct sr_arpsend *out;
+    sr_ethernet_hdr_t *ethhdr;
+    sr_arp_hdr_t *arphdr;
+    struct sr_if *iface = sr_get_interface_id(sr, ifid);
+
+    if (!iface)
+        return -1;
+    if (cache->noutbox == SR_ARP_OUTBOX ||
+        sr_arpcache_take_token(iface) != 0) {
+        cache->rate_limited++;
+        return 1;
+    }
+
+    out = &(cache->outbox[cache->noutbox++]);
+    out->ifid = ifid;
+    ethhdr = (sr_ethernet_hdr_t *)out->frame;
+    arphdr = (sr_arp_hdr_t *)(out->frame + sizeof(sr_ethernet_hdr_t));
+
+    if (dst)
+        memcpy(ethhdr->ether_dhost, dst, ETHER_ADDR_LEN);
+    else
+        memset(ethhdr->ether_dhost, 0xff, ETHER_ADDR_LEN);
+    memcpy(ethhdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
+    ethhdr->ether_type = htons(ethertype_arp);
+
+    arphdr->ar_hrd = htons(arp_hrd_ethernet);
+    arphdr->ar_pro = htons(ethertype_ip);
+    arphdr->ar_hln = ETHER_ADDR_LEN;
+    arphdr->ar_pln = 4;
+    arphdr->ar_op = htons(arp_op_request);
+    memcpy(arphdr->ar_sha, iface->addr, ETHER_ADDR_LEN);
+    arphdr->ar_sip = iface->ip;
+    if (dst)
+        memcpy(arphdr->ar_tha, dst, ETHER_ADDR_LEN);
+    else
+        memset(arphdr->ar_tha, 0x00, ETHER_ADDR_LEN);
+    arphdr->ar_tip = ip;
+
+    return 0;
+}
+
+/* Sends the requests in the outbox, oldest first, each with the lock
+   released around the write. Caller holds the lock, once. */
+static void sr_arpcache_send_outbox(struct sr_instance *sr) {
+    struct sr_arpcache *cache = &(sr->cache);
+    struct sr_arpsend out;
+
+    while (cache->outbox_head < cache->noutbox) {
+        out = cache->outbox[cache->outbox_head++];
+        if (cache->outbox_head == cache->noutbox)
+            cache->outbox_head = cache->noutbox = 0;
+
+        pthread_mutex_unlock(&(cache->lock));
+        sr_send_packet_id(sr, out.frame, sizeof(out.frame), out.ifid);
+        pthread_mutex_lock(&(cache->lock));
+    }
+}
+
+/* Returns the link that points at ip's negative entry, or at the NULL
+   ending its bucket if there is none. Caller holds the lock. */
+static struct sr_arpneg **sr_arpneg_link(struct sr_arpcache *cache,
+                                         uint32_t ip)
+{
+    struct sr_arpneg **link;
+
+    link = &(cache->neg[sr_arpcache_hash(ip) & (SR_ARPNEG_SZ - 1)]);
+    while (*link && (*link)->ip != ip)
+        link = &((*link)->next);
+
+    return link;
+}
+
+/* Drops ip from the negative cache, if it's there. Caller holds the
+   lock. */
+static void sr_arpneg_remove(struct sr_arpcache *cache, uint32_t ip) {
+    struct sr_arpneg **link = sr_arpneg_link(cache, ip);
+    struct sr_arpneg *neg = *link;
+
+    if (!neg)
+        return;
+    *link = neg->next;
+    sr_timer_del(&(cache->timers), &(neg->timer));
+    free(neg);
+    cache->nneg--;
+}
+
+/* Timer callback: a dead IP has served its SR_ARPNEG_MS. */
+static void sr_arpneg_expire(struct sr_timer *timer, void *arg) {
+    sr_arpneg_remove((struct sr_arpcache *)arg,
+                     ((struct sr_arpneg *)timer)->ip);
+}
+
+/* Marks ip dead for SR_ARPNEG_MS. Once the negative cache is full further
+   IPs aren't remembered. Caller holds the lock. */
+static void sr_arpneg_add(struct sr_arpcache *cache, uint32_t ip) {
+    struct sr_arpneg **link = sr_arpneg_link(cache, ip);
+    struct sr_arpneg *neg = *link;
+
+    if (!neg) {
+        if (cache->nneg >= SR_ARPNEG_MAX)
+            return;
+        neg = (struct sr_arpneg *)malloc(sizeof(struct sr_arpneg));
+        if (!neg)
+            return;
+        sr_timer_init(&(neg->timer), sr_arpneg_expire, cache);
+        neg->ip = ip;
+        neg->next = NULL;
+        *link = neg;
+        cache->nneg++;
+    }
+
+    sr_arpcache_schedule(cache, &(neg->timer),
+                         sr_timer_now_ms() + SR_ARPNEG_MS);
+}
+
+int sr_arpcache_unreachable(struct sr_arpcache *cache, uint32_t ip) {
+    int dead;
+
+    pthread_mutex_lock(&(cache->lock));
+
+    dead = *sr_arpneg_link(cache, ip) != NULL;
+    if (dead)
+        cache->neg_drops++;
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    return dead;
+}
+
+/* Timer callback: an entry is SR_ARPCACHE_REFRESH_MS from the end of its
+   lifetime, or at it. The first time, an entry that has been used gets a
+   unicast request to its MAC; either way it stays until the end of its
+   lifetime, when it is removed unless a reply has restarted it. Runs on
+   the cleanup thread with the lock held. */
+static void sr_arpcache_expire(struct sr_timer *timer, void *arg) {
+    struct sr_arpcache *cache = arg;
+    struct sr_arpexpiry *expiry = (struct sr_arpexpiry *)timer;
+    struct sr_arpentry *entry = sr_arpcache_find(cache, expiry->ip);
+
+    if (!entry || entry->expiry != expiry) {
+        sr_pool_free(expiry);
+        return;
+    }
+
+    if (!expiry->refreshing) {
+        if (__atomic_load_n(&(entry->used), __ATOMIC_RELAXED) && cache->sr &&
+            sr_arpcache_send_request(cache->sr, expiry->ifid, expiry->ip,
+                                     entry->mac) == 0) {
+            expiry->probed = 1;
+            cache->refreshes++;
+        }
+        expiry->refreshing = 1;
+        sr_arpcache_schedule(cache, timer,
+                             timer->expires + SR_ARPCACHE_REFRESH_MS);
+        return;
+    }
+
+    sr_arpcache_write_begin(cache);
+    sr_arpcache_remove(cache, entry - cache->table->entries);
+    sr_arpcache_write_end(cache);
+    __atomic_add_fetch(&(cache->gen), 1, __ATOMIC_RELEASE);
+}
+
+/* Timer callback: a request has gone SR_ARPREQ_RETRY_MS unanswered. */
+static void sr_arpreq_retry(struct sr_timer *timer, void *arg) {
+    struct sr_arpcache *cache = arg;
+
+    if (cache->sr)
+        handle_arpreq(cache->sr, (struct sr_arpreq *)timer);
+}
+
+/* Makes an ARP request for req out of req->ifid, to be sent from the
+   outbox, and schedules the next one, or gives up on req once
+   SR_ARPREQ_TRIES have gone unanswered. */
+void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
+    struct sr_arpcache *cache = &(sr->cache);
+
+    pthread_mutex_lock(&(cache->lock));
+
+    if (req->tries >= SR_ARPREQ_TRIES) {
+        /* send icmp host unreachable to source addr of all pkts waiting on this request */
+        sr_arpneg_add(cache, req->ip);
+        sr_arpreq_destroy(cache, req);
+        pthread_mutex_unlock(&(cache->lock));
+        return;
+    }
+
+    /* make an arp request, unless the interface's rate limit holds it
+       back; a held back one still counts towards giving up */
+    req->tries++;
+    if (sr_arpcache_send_request(sr, req->ifid, req->ip, NULL) != 1) {
+        req->sent = time(NULL);
+        req->times_sent++;
+    }
+    sr_arpcache_schedule(cache, &(req->timer),
+                         sr_timer_now_ms() + SR_ARPREQ_RETRY_MS);
+
+    pthread_mutex_unlock(&(cache->lock));
+}
 
-/*
-  This function gets called every second. For each request sent out, we keep
-  checking whether we should resend a request or destroy the arp request.
-  See the comments in the header file for an idea of what it should look like.
-*/
-void sr_arpcache_sweepreqs(struct sr_instance *sr) {
-  /* Fill this in */
-  struct arpreq *req;
-
-  /* for(req = sr->cache.requests; req != NULL; req = req->next) {
-    handle_arpreq(sr->cache,req);
-  } */
-}
-
-void handle_arpreq(struct sr_arpcache *cache,
-		   struct sr_instance *sr,
-		   struct sr_arpreq *req,
-		   uint8_t buf[],
-		   char *interface)
+void sr_arpcache_send_requests(struct sr_instance *sr) {
+    pthread_mutex_lock(&(sr->cache.lock));
+    sr_arpcache_send_outbox(sr);
+    pthread_mutex_unlock(&(sr->cache.lock));
+}
+
+/* Copies the MAC for ip (network byte order) into mac and returns 1, or
+   returns 0 if there is no mapping. Takes no lock and allocates nothing:
+   the probe runs against whatever table is current and is simply retried
+   if a writer changed the table meanwhile (seq moved or was odd). The
+   epoch read section keeps a table swapped out by a resize from being
+   freed under us. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip,
+                           unsigned char *mac)
 {
-  time_t now = time(0);
+    struct sr_arptable *t;
+    struct sr_arpentry *entry;
+    uint32_t seq, i, n;
+
+    sr_epoch_enter(&(cache->epoch));
+
+    for (;;) {
+        seq = __atomic_load_n(&(cache->seq), __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        t = __atomic_load_n(&(cache->table), __ATOMIC_ACQUIRE);
+        entry = NULL;
+        i = sr_arpcache_home(t, ip);
+
+        /* Bounded, a torn read could make the run look endless */
+        for (n = 0; n < t->size && t->entries[i].valid; n++) {
+            if (t->entries[i].ip == ip) {
+                entry = &(t->entries[i]);
+                memcpy(mac, entry->mac, 6);
+                break;
+            }
+            i = (i + 1) & (t->size - 1);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(cache->seq), __ATOMIC_RELAXED) == seq)
+            break;
+    }
+
+    /* Only write the shared line when a bit actually changes */
+    if (entry && !__atomic_load_n(&(entry->referenced), __ATOMIC_RELAXED))
+        __atomic_store_n(&(entry->referenced), 1, __ATOMIC_RELAXED);
+    if (entry && !__atomic_load_n(&(entry->used), __ATOMIC_RELAXED))
+        __atomic_store_n(&(entry->used), 1, __ATOMIC_RELAXED);
 
-  if(difftime(now, req->sent) > 1.0) {
-	if(req->times_sent >= 5) {
-	  /* send icmp host unreachable to source addr of all pkts waiting on this request */
-	  sr_arpreq_destroy(cache,req);
-	}
-	else {
-	  /* send arp request */
-	  sr_send_packet(sr,buf,42,interface);
+    sr_epoch_exit(&(cache->epoch));
 
-	  req->sent = now;
-	  req->times_sent++;
-	}
-  }
+    return entry != NULL;
 }
 
 /* You should not need to touch the rest of this code. */
@@ -57,16 +519,13 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
 
     struct sr_arpentry *entry = NULL, *copy = NULL;
 
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
-        }
-    }
+    entry = sr_arpcache_find(cache, ip);
 
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
     if (entry) {
+        __atomic_store_n(&(entry->referenced), 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&(entry->used), 1, __ATOMIC_RELAXED);
         copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
         memcpy(copy, entry, sizeof(struct sr_arpentry));
     }
@@ -86,36 +545,88 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet,           /* borrowed */
                                        unsigned int packet_len,
-                                       char *iface)
+                                       int ifid,
+                                       struct sr_mbuf *mbuf)      /* borrowed */
 {
     pthread_mutex_lock(&(cache->lock));
 
-    struct sr_arpreq *req;
-    for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {
-            break;
-        }
-    }
+    struct sr_arpreq **link = sr_arpreq_link(cache, ip);
+    struct sr_arpreq *req = *link;
 
     /* If the IP wasn't found, add it */
     if (!req) {
-        req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
+        req = (struct sr_arpreq *) sr_pool_alloc(&(cache->reqs_pool));
+        if (!req) {
+            pthread_mutex_unlock(&(cache->lock));
+            return NULL;
+        }
+        memset(req, 0, sizeof(struct sr_arpreq));
         req->ip = ip;
-        req->next = cache->requests;
-        cache->requests = req;
+        sr_timer_init(&(req->timer), sr_arpreq_retry, cache);
+        req->ifid = ifid;
+        *link = req;
+        if (++cache->nreqs > cache->reqs_size)
+            sr_arpreq_grow(cache);
     }
 
-    /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
-
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+    /* Add the packet to the list of packets for this request, making room
+       or dropping it as the limits say */
+    if (packet && packet_len && ifid != SR_IF_NONE) {
+        int room = 1;
+
+        if (req->npackets >= cache->queue_max) {
+            if (cache->queue_policy == SR_ARPQ_DROP_OLDEST) {
+                while (req->npackets >= cache->queue_max) {
+                    sr_arpreq_drop_oldest(cache, req);
+                    cache->queue_drops++;
+                }
+            }
+            else {
+                cache->queue_drops++;
+                room = 0;
+            }
+        }
+
+        if (room && cache->queued_bytes + SR_ARPQ_CHARGE > cache->queue_budget) {
+            if (cache->queue_policy == SR_ARPQ_DROP_OLDEST) {
+                while (req->packets &&
+                       cache->queued_bytes + SR_ARPQ_CHARGE > cache->queue_budget) {
+                    sr_arpreq_drop_oldest(cache, req);
+                    cache->budget_drops++;
+                }
+            }
+            if (cache->queued_bytes + SR_ARPQ_CHARGE > cache->queue_budget) {
+                cache->budget_drops++;
+                room = 0;
+            }
+        }
+
+        /* Keep the packet in a frame sized buffer, copied if it arrived in
+           a receive buffer (see sr_mbuf.h) */
+        if (room && (mbuf = sr_mbuf_keep(mbuf, &packet, packet_len)) == NULL)
+            room = 0;
+
+        if (room) {
+            struct sr_packet *new_pkt = (struct sr_packet *)sr_pool_alloc(&(cache->pkts_pool));
+
+            if (!new_pkt) {
+                sr_mbuf_put(mbuf);
+                pthread_mutex_unlock(&(cache->lock));
+                return req;
+            }
+            new_pkt->buf = packet;
+            new_pkt->mbuf = mbuf;
+            new_pkt->len = packet_len;
+            new_pkt->ifid = ifid;
+            new_pkt->next = NULL;
+            if (req->last)
+                req->last->next = new_pkt;
+            else
+                req->packets = new_pkt;
+            req->last = new_pkt;
+            req->npackets++;
+            cache->queued_bytes += SR_ARPQ_CHARGE;
+        }
     }
 
     pthread_mutex_unlock(&(cache->lock));
@@ -126,41 +637,96 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping in the cache, and marks it valid.
+      An existing mapping for the IP is updated in place; if the cache is
+      at its cap, another mapping is evicted to make room. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip)
+                                     uint32_t ip,
+                                     int ifid)
 {
     pthread_mutex_lock(&(cache->lock));
 
-    struct sr_arpreq *req, *prev = NULL, *next = NULL;
-    for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {
-            if (prev) {
-                next = req->next;
-                prev->next = next;
-            }
-            else {
-                next = req->next;
-                cache->requests = next;
-            }
+    struct sr_arpreq **link = sr_arpreq_link(cache, ip);
+    struct sr_arpreq *req = *link;
+    if (req) {
+        *link = req->next;
+        req->next = NULL;
+        cache->nreqs--;
 
-            break;
+        /* Answered, the caller sends its packets and destroys it */
+        sr_timer_del(&(cache->timers), &(req->timer));
+    }
+
+    struct sr_arpentry *entry = sr_arpcache_find(cache, ip);
+    struct sr_arpexpiry *expiry = NULL;
+    struct sr_arptable *t;
+    int changed = !entry || memcmp(entry->mac, mac, 6) != 0;
+
+    /* A mapping that could never time out isn't learned at all */
+    if (!entry) {
+        expiry = (struct sr_arpexpiry *)sr_pool_alloc(&(cache->expiry_pool));
+        if (!expiry) {
+            fprintf(stderr, "Error: out of memory (sr_arpcache_insert)\n");
+            pthread_mutex_unlock(&(cache->lock));
+            return req;
         }
-        prev = req;
+        sr_timer_init(&(expiry->timer), sr_arpcache_expire, cache);
+        expiry->ip = ip;
+        expiry->ifid = SR_IF_NONE;
     }
 
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
-            break;
+    /* Not dead after all */
+    if (cache->nneg)
+        sr_arpneg_remove(cache, ip);
+
+    /* The answer to a refresh, so the entry never went away */
+    if (entry && entry->expiry && entry->expiry->probed && !changed)
+        cache->refresh_saves++;
+
+    /* Growing swaps in a new table, do that before the write section */
+    if (!entry && cache->count < cache->max_entries &&
+        (cache->count + 1) * 2 > cache->table->size)
+        sr_arpcache_resize(cache, cache->table->size * 2);
+
+    sr_arpcache_write_begin(cache);
+
+    if (!entry) {
+        /* At the cap (or if growing failed and we're full), make room */
+        t = cache->table;
+        if (cache->count >= cache->max_entries || cache->count + 1 >= t->size)
+            sr_arpcache_evict(cache);
+
+        uint32_t i = sr_arpcache_home(t, ip);
+        while (t->entries[i].valid)
+            i = (i + 1) & (t->size - 1);
+        entry = &(t->entries[i]);
+        entry->ip = ip;
+        entry->valid = 1;
+        entry->expiry = expiry;
+        cache->count++;
     }
 
-    if (i != SR_ARPCACHE_SZ) {
-        memcpy(cache->entries[i].mac, mac, 6);
-        cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
-        cache->entries[i].valid = 1;
+    memcpy(entry->mac, mac, 6);
+    entry->added = time(NULL);
+    entry->referenced = 1;
+    entry->used = 0;
+
+    /* Cached copies of an unchanged mapping stay good */
+    if (changed)
+        __atomic_add_fetch(&(cache->gen), 1, __ATOMIC_RELEASE);
+
+    sr_arpcache_write_end(cache);
+
+    /* Learning a mapping again restarts its lifetime */
+    if (entry->expiry) {
+        if (ifid != SR_IF_NONE)
+            entry->expiry->ifid = ifid;
+        entry->expiry->refreshing = 0;
+        entry->expiry->probed = 0;
+        sr_arpcache_schedule(cache, &(entry->expiry->timer),
+                             sr_timer_now_ms() + SR_ARPCACHE_TO * 1000 -
+                             SR_ARPCACHE_REFRESH_MS);
     }
 
     pthread_mutex_unlock(&(cache->lock));
@@ -168,41 +734,126 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
     return req;
 }
 
+uint32_t sr_arpcache_export(struct sr_instance *sr, struct sr_arpsnap *out,
+                            uint32_t max)
+{
+    struct sr_arpcache *cache = &(sr->cache);
+    struct sr_if *iface;
+    uint32_t i, n = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&(cache->lock));
+
+    for (i = 0; i < cache->table->size && n < max; i++) {
+        struct sr_arpentry *cur = &(cache->table->entries[i]);
+        if (!cur->valid)
+            continue;
+        memset(&(out[n]), 0, sizeof(struct sr_arpsnap));
+        out[n].ip = cur->ip;
+        memcpy(out[n].mac, cur->mac, 6);
+        out[n].age = now > cur->added ? now - cur->added : 0;
+        /* Numbers may differ next time, names don't */
+        if (cur->expiry &&
+            (iface = sr_get_interface_id(sr, cur->expiry->ifid)) != NULL)
+            memcpy(out[n].iface, iface->name, sr_IFACE_NAMELEN);
+        n++;
+    }
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    return n;
+}
+
+void sr_arpcache_restore(struct sr_arpcache *cache, const struct sr_arpsnap *snap,
+                         int ifid, uint32_t verify_ms)
+{
+    struct sr_arpentry *entry;
+    unsigned char mac[6];
+
+    memcpy(mac, snap->mac, 6);
+
+    pthread_mutex_lock(&(cache->lock));
+
+    /* Whatever was learned since startup is newer */
+    if (sr_arpcache_find(cache, snap->ip) || *sr_arpreq_link(cache, snap->ip)) {
+        pthread_mutex_unlock(&(cache->lock));
+        return;
+    }
+
+    /* No request is waiting on it, and the lock is recursive */
+    sr_arpcache_insert(cache, mac, snap->ip, ifid);
+
+    /* Mark it used so that its refresh goes out, and bring that forward */
+    entry = sr_arpcache_find(cache, snap->ip);
+    if (entry && entry->expiry) {
+        entry->added -= snap->age;
+        entry->used = 1;
+        sr_arpcache_schedule(cache, &(entry->expiry->timer),
+                             sr_timer_now_ms() + verify_ms);
+    }
+
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+void sr_arpcache_set_queue(struct sr_arpcache *cache, uint32_t queue_max,
+                           int policy, size_t budget)
+{
+    pthread_mutex_lock(&(cache->lock));
+
+    cache->queue_max = queue_max ? queue_max : 1;
+    cache->queue_policy = policy;
+    cache->queue_budget = budget;
+
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+void sr_arpcache_set_max(struct sr_arpcache *cache, uint32_t max_entries) {
+    pthread_mutex_lock(&(cache->lock));
+
+    cache->max_entries = max_entries ? max_entries : 1;
+    sr_arpcache_write_begin(cache);
+    while (cache->count > cache->max_entries)
+        sr_arpcache_evict(cache);
+    sr_arpcache_write_end(cache);
+
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+uint32_t sr_arpcache_generation(struct sr_arpcache *cache) {
+    return __atomic_load_n(&(cache->gen), __ATOMIC_ACQUIRE);
+}
+
+uint32_t sr_arpcache_round(struct sr_arpcache *cache) {
+    return __atomic_load_n(&(cache->round), __ATOMIC_RELAXED);
+}
+
+/* Timer callback: moves the round on, see sr_arpcache_round. */
+static void sr_arpcache_next_round(struct sr_timer *timer, void *arg) {
+    struct sr_arpcache *cache = arg;
+
+    __atomic_store_n(&(cache->round), cache->round + 1, __ATOMIC_RELAXED);
+    sr_timer_add(&(cache->timers), timer,
+                 timer->expires + SR_ARPCACHE_ROUND_MS);
+}
+
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
     pthread_mutex_lock(&(cache->lock));
 
     if (entry) {
-        struct sr_arpreq *req, *prev = NULL, *next = NULL;
-        for (req = cache->requests; req != NULL; req = req->next) {
-            if (req == entry) {
-                if (prev) {
-                    next = req->next;
-                    prev->next = next;
-                }
-                else {
-                    next = req->next;
-                    cache->requests = next;
-                }
-
-                break;
-            }
-            prev = req;
+        struct sr_arpreq **link = sr_arpreq_link(cache, entry->ip);
+        if (*link == entry) {
+            *link = entry->next;
+            cache->nreqs--;
         }
 
-        struct sr_packet *pkt, *nxt;
+        sr_timer_del(&(cache->timers), &(entry->timer));
 
-        for (pkt = entry->packets; pkt; pkt = nxt) {
-            nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
-        }
+        while (entry->packets)
+            sr_arpreq_drop_oldest(cache, entry);
 
-        free(entry);
+        sr_pool_free(entry);
     }
 
     pthread_mutex_unlock(&(cache->lock));
@@ -210,27 +861,103 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
 
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache) {
+    pthread_mutex_lock(&(cache->lock));
+
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
     fprintf(stderr, "-----------------------------------------------------------\n");
 
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        struct sr_arpentry *cur = &(cache->entries[i]);
+    uint32_t i;
+    for (i = 0; i < cache->table->size; i++) {
+        struct sr_arpentry *cur = &(cache->table->entries[i]);
         unsigned char *mac = cur->mac;
+        if (!cur->valid)
+            continue;
         fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
     }
 
+    fprintf(stderr, "%u entries (cap %u) in %u slots, %llu evicted, "
+            "%u timers pending\n",
+            cache->count, cache->max_entries, cache->table->size,
+            (unsigned long long)cache->evictions, cache->timers.count);
+    fprintf(stderr, "%llu refreshes sent, %llu answered before expiry\n",
+            (unsigned long long)cache->refreshes,
+            (unsigned long long)cache->refresh_saves);
+    fprintf(stderr, "%u IPs unresolvable, %llu packets to them dropped, "
+            "%llu requests held back by rate limits\n",
+            cache->nneg, (unsigned long long)cache->neg_drops,
+            (unsigned long long)cache->rate_limited);
+    fprintf(stderr, "%u requests pending, %lu bytes queued (budget %lu), "
+            "%llu dropped by queue limit, %llu by budget\n",
+            cache->nreqs, (unsigned long)cache->queued_bytes,
+            (unsigned long)cache->queue_budget,
+            (unsigned long long)cache->queue_drops,
+            (unsigned long long)cache->budget_drops);
     fprintf(stderr, "\n");
+
+    pthread_mutex_unlock(&(cache->lock));
 }
 
 /* Initialize table + table lock. Returns 0 on success. */
 int sr_arpcache_init(struct sr_arpcache *cache) {
-    /* Seed RNG to kick out a random entry if all entries full. */
-    srand(time(NULL));
-
-    /* Invalidate all entries */
-    memset(cache->entries, 0, sizeof(cache->entries));
-    cache->requests = NULL;
+    size_t len = SR_ARPCACHE_SZ * sizeof(struct sr_arpentry);
+
+    /* Start small, the table grows as neighbors are learned */
+    cache->table = (struct sr_arptable *)malloc(sizeof(struct sr_arptable));
+    if (!cache->table)
+        return -1;
+    cache->table->size = SR_ARPCACHE_SZ;
+    cache->table->entries = (struct sr_arpentry *)sr_arena_alloc(&len, "ARP", "table");
+    if (!cache->table->entries)
+        return -1;
+    cache->seq = 0;
+    sr_epoch_init(&(cache->epoch));
+    cache->count = 0;
+    cache->max_entries = SR_ARPCACHE_MAX;
+    cache->hand = 0;
+    cache->evictions = 0;
+    if (sr_mbuf_pool_init(&(cache->reqs_pool), "ARP requests",
+                          sizeof(struct sr_arpreq), SR_ARPREQ_SZ) != 0 ||
+        sr_mbuf_pool_init(&(cache->pkts_pool), "ARP queue",
+                          sizeof(struct sr_packet), SR_ARPREQ_QLEN) != 0 ||
+        sr_mbuf_pool_init(&(cache->expiry_pool), "ARP timers",
+                          sizeof(struct sr_arpexpiry), SR_ARPCACHE_SZ) != 0)
+        return -1;
+    cache->reqs = (struct sr_arpreq **)calloc(SR_ARPREQ_SZ, sizeof(struct sr_arpreq *));
+    if (!cache->reqs)
+        return -1;
+    cache->reqs_size = SR_ARPREQ_SZ;
+    cache->nreqs = 0;
+    cache->queue_max = SR_ARPREQ_QLEN;
+    cache->queue_policy = SR_ARPQ_DROP_NEWEST;
+    cache->queue_budget = SR_ARPREQ_BUDGET;
+    cache->queued_bytes = 0;
+    cache->queue_drops = 0;
+    cache->budget_drops = 0;
+    memset(cache->neg, 0, sizeof(cache->neg));
+    cache->nneg = 0;
+    cache->neg_drops = 0;
+    cache->rate_limited = 0;
+    assert(sizeof(cache->outbox[0].frame) ==
+           sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t));
+    cache->outbox_head = 0;
+    cache->noutbox = 0;
+    cache->gen = 0;
+    sr_timer_wheel_init(&(cache->timers), sr_timer_now_ms());
+    cache->wake = SR_TIMER_NEVER;
+    cache->sr = NULL;
+    cache->round = 0;
+    sr_timer_init(&(cache->round_timer), sr_arpcache_next_round, cache);
+    sr_timer_add(&(cache->timers), &(cache->round_timer),
+                 cache->timers.now + SR_ARPCACHE_ROUND_MS);
+    cache->refreshes = 0;
+    cache->refresh_saves = 0;
+
+    /* Timers run on the monotonic clock, so must the cleanup thread's waits */
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(cache->cond), &condattr);
+    pthread_condattr_destroy(&condattr);
 
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
@@ -242,34 +969,50 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    uint32_t i;
+    for (i = 0; i < cache->table->size; i++)
+        if (cache->table->entries[i].valid)
+            sr_pool_free(cache->table->entries[i].expiry);
+    for (i = 0; i < cache->reqs_size; i++)
+        while (cache->reqs[i])
+            sr_arpreq_destroy(cache, cache->reqs[i]);
+    free(cache->reqs);
+    for (i = 0; i < SR_ARPNEG_SZ; i++)
+        while (cache->neg[i])
+            sr_arpneg_remove(cache, cache->neg[i]->ip);
+    pthread_cond_destroy(&(cache->cond));
+    sr_arena_free(cache->table->entries);
+    free(cache->table);
+    cache->table = NULL;
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
+/* Thread which runs the cache's timers: it times out entries learned more
+   than SR_ARPCACHE_TO seconds ago and retries ARP requests. It sleeps until
+   the next timer is due, and only holds the lock while timers run; the
+   requests they make are sent after. */
 void *sr_arpcache_timeout(void *sr_ptr) {
     struct sr_instance *sr = sr_ptr;
     struct sr_arpcache *cache = &(sr->cache);
+    struct timespec ts;
 
-    while (1) {
-        sleep(1.0);
-
-        pthread_mutex_lock(&(cache->lock));
-
-        time_t curtime = time(NULL);
+    pthread_mutex_lock(&(cache->lock));
+    cache->sr = sr;
 
-        int i;
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
+    while (1) {
+        sr_timer_advance(&(cache->timers), sr_timer_now_ms());
+        sr_arpcache_send_outbox(sr);
+
+        /* Anyone scheduling sooner than this signals cond */
+        cache->wake = sr_timer_next(&(cache->timers));
+        if (cache->wake == SR_TIMER_NEVER)
+            pthread_cond_wait(&(cache->cond), &(cache->lock));
+        else {
+            ts.tv_sec = cache->wake / 1000;
+            ts.tv_nsec = (cache->wake % 1000) * 1000000;
+            pthread_cond_timedwait(&(cache->cond), &(cache->lock), &ts);
         }
-
-        sr_arpcache_sweepreqs(sr);
-
-        pthread_mutex_unlock(&(cache->lock));
     }
 
     return NULL;
 }
-
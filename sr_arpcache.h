@@ -2,7 +2,7 @@
    request queue, and ARP cache entries. The ARP request queue holds data about
    an outgoing ARP cache request and the packets that are waiting on a reply
    to that ARP cache request. The ARP cache entries hold IP->MAC mappings and
-   are timed out every SR_ARPCACHE_TO seconds.
+   are timed out SR_ARPCACHE_TO seconds after they were last learned.
 
    Pseudocode for use of these structures follows.
 
@@ -48,19 +48,33 @@
 
    --
 
-   To meet the guidelines in the assignment (ARP requests are sent every second
-   until we send 5 ARP requests, then we send ICMP host unreachable back to
-   all packets waiting on this ARP request), you must fill out the following
-   function that is called every second and is defined in sr_arpcache.c:
+   ARP requests are sent every second until we send 5 ARP requests, then we
+   send ICMP host unreachable back to all packets waiting on this ARP request.
+   Nothing polls for that: each sr_arpreq and each cache entry carries a timer
+   on the cache's timing wheel (see sr_timer.h), and the cleanup thread sleeps
+   until the next one is due. handle_arpreq sends a request and schedules its
+   own retry SR_ARPREQ_RETRY_MS later; an entry's timer removes it when it
+   expires.
 
-   void sr_arpcache_sweepreqs(struct sr_instance *sr) {
-       for each request on sr->cache.requests:
-           handle_arpreq(request)
-   }
+   Entries looked up since they were learned are not left to expire under
+   traffic: SR_ARPCACHE_REFRESH_MS before the end of their lifetime their
+   timer sends a unicast ARP request to the cached MAC, and the old mapping
+   keeps forwarding until the reply restarts its lifetime. Idle entries
+   age out as before. Forwarding paths that keep a MAC of their own (flow
+   cache, adjacencies) look it up again once per round so the entry is
+   seen in use.
 
-   Since handle_arpreq as defined in the comments above could destroy your
-   current request, make sure to save the next pointer before calling
-   handle_arpreq when traversing through the ARP requests linked list.
+   An IP that goes SR_ARPREQ_TRIES requests without an answer is held in a
+   negative cache for SR_ARPNEG_MS; packets to it are dropped at once
+   instead of being queued behind yet another round of requests. Requests
+   also leave each interface through a token bucket (SR_ARP_RATE a second,
+   bursts of SR_ARP_BURST); one held back is tried again a retry later and
+   doesn't count as sent.
+
+   Timers and handle_arpreq run with the lock held, but don't send: the
+   requests they make wait in the cache's outbox and go out once the lock
+   is released (sr_arpcache_send_requests), so forwarding threads that
+   queue on a request never wait behind a write to the server.
  */
 
 #ifndef SR_ARPCACHE_H
@@ -70,14 +84,41 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_epoch.h"
+#include "sr_timer.h"
+#include "sr_mbuf.h"
 
-#define SR_ARPCACHE_SZ    100
+#define SR_ARPCACHE_SZ    128       /* Initial slots, a power of two */
+#define SR_ARPCACHE_MAX   131072    /* Default cap on entries */
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPCACHE_REFRESH_MS 3000 /* Used entries are re-ARPed this long
+                                       before they expire */
+#define SR_ARPCACHE_ROUND_MS 1000   /* See sr_arpcache_round */
+#define SR_ARPREQ_RETRY_MS 1000     /* Between requests for one IP */
+#define SR_ARPREQ_TRIES   5         /* Requests sent before giving up */
+#define SR_ARPNEG_MS      20000     /* Unresolvable IPs are dead this long */
+#define SR_ARPNEG_SZ      4096      /* Negative cache buckets, a power of two */
+#define SR_ARPNEG_MAX     16384     /* Most IPs the negative cache holds */
+#define SR_ARP_RATE       100       /* ARP requests a second per interface */
+#define SR_ARP_BURST      20        /* ... sent back to back at most */
+#define SR_ARP_OUTBOX     (SR_ARP_BURST * SR_IF_MAX) /* Requests made under
+                                       the lock, waiting to be sent */
+#define SR_ARP_FRAME      42        /* Ethernet and ARP headers */
+#define SR_ARPREQ_SZ      64        /* Initial request buckets, a power of two */
+#define SR_ARPREQ_QLEN    64        /* Default packets queued per request */
+#define SR_ARPREQ_BUDGET  (4 << 20) /* Default bytes queued over all requests */
+
+/* What a request whose packet queue is full does with one more */
+#define SR_ARPQ_DROP_NEWEST 0       /* Drop the arriving packet */
+#define SR_ARPQ_DROP_OLDEST 1       /* Drop the head of the queue for it */
+
+struct sr_instance;
 
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    int ifid;                   /* The outgoing interface's number */
+    struct sr_mbuf *mbuf;       /* Buffer buf is in, a reference is held */
     struct sr_packet *next;
 };
 
@@ -86,22 +127,126 @@ struct sr_arpentry {
     uint32_t ip;                /* IP addr in network byte order */
     time_t added;
     int valid;
+    int referenced;             /* Used since the CLOCK hand last passed */
+    int used;                   /* Looked up since last learned */
+    struct sr_arpexpiry *expiry; /* Times the entry out, see below */
+};
+
+/* Entries move around the table, so their timers live outside it, in
+   a pool of the cache's */
+struct sr_arpexpiry {
+    struct sr_timer timer;      /* First, the callback casts back */
+    uint32_t ip;
+    int refreshing;             /* Past the refresh point, the timer is now
+                                   the end of the entry's lifetime */
+    int probed;                 /* A refresh was sent at that point */
+    int ifid;                   /* Interface the mapping was learned on */
 };
 
 struct sr_arpreq {
+    struct sr_timer timer;      /* Next retry. First, the callback casts
+                                   back */
     uint32_t ip;
     time_t sent;                /* Last time this ARP request was sent. You
                                    should update this. If the ARP request was
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
-    struct sr_arpreq *next;
+    uint32_t tries;             /* Times it was due, sent or held back by the
+                                   rate limit; gives up at SR_ARPREQ_TRIES */
+    int ifid;                   /* Interface the request goes out of */
+    struct sr_packet *packets;  /* List of pkts waiting on this req to finish,
+                                   oldest first */
+    struct sr_packet *last;     /* Newest packet, NULL if none */
+    uint32_t npackets;
+    struct sr_arpreq *next;     /* Next request in the same bucket */
+};
+
+/* One mapping as written to a warm start snapshot (see sr_snapshot.h).
+   Fixed size and layout, the snapshot is mapped back in as an array. */
+struct sr_arpsnap {
+    uint32_t ip;                /* Network byte order */
+    unsigned char mac[6];
+    uint16_t pad;
+    uint32_t age;               /* Seconds since it was learned */
+    char iface[sr_IFACE_NAMELEN]; /* Interface it was learned on */
+};
+
+/* An IP recently found unresolvable, see above */
+struct sr_arpneg {
+    struct sr_timer timer;      /* First, the callback casts back */
+    uint32_t ip;
+    struct sr_arpneg *next;     /* Next in the same bucket */
+};
+
+/* An ARP request made but not sent yet, see above */
+struct sr_arpsend {
+    int ifid;
+    uint8_t frame[SR_ARP_FRAME];
+};
+
+/* The mappings live in an open addressing hash table keyed by IP (linear
+   probing, at most half full).  It doubles as it fills, up to max_entries
+   mappings; past that, inserting evicts an entry chosen by the CLOCK
+   algorithm, sparing those looked up since the hand last went by.
+
+   Pending requests are hashed by IP into chained buckets, which double
+   once there are more requests than buckets. Each holds at most
+   queue_max packets, and all of them together at most queue_budget bytes;
+   each packet counts as the SR_MBUF_FRAME byte buffer it is kept in, so
+   the budget bounds the memory queued packets hold, however short they
+   are.  queue_policy picks which packet goes when a request's queue is
+   full.
+   Over the budget, a drop-oldest request makes room from its own queue,
+   otherwise the arriving packet is dropped.
+
+   Writers hold the lock.  sr_arpcache_lookup_mac reads without it: seq is
+   a sequence lock over the table contents, and tables replaced by a
+   resize are freed through the epoch once no reader can see them. */
+struct sr_arptable {
+    uint32_t size;              /* Slots in entries, a power of two */
+    struct sr_arpentry *entries;
 };
 
 struct sr_arpcache {
-    struct sr_arpentry entries[SR_ARPCACHE_SZ];
-    struct sr_arpreq *requests;
+    struct sr_arptable *table;
+    uint32_t seq;               /* Odd while a writer changes the table */
+    struct sr_epoch epoch;      /* Readers of table */
+    uint32_t count;             /* Valid entries */
+    uint32_t max_entries;
+    uint32_t hand;              /* CLOCK hand, a slot index */
+    uint64_t evictions;
+    struct sr_mbuf_pool reqs_pool; /* Where they and packets queued on them */
+    struct sr_mbuf_pool pkts_pool; /* come from, see sr_mbuf.h */
+    struct sr_mbuf_pool expiry_pool; /* Entries' struct sr_arpexpiry */
+    struct sr_arpreq **reqs;    /* Pending requests, see above */
+    uint32_t reqs_size;         /* Buckets in reqs, a power of two */
+    uint32_t nreqs;
+    uint32_t queue_max;         /* Packets queued per request */
+    int queue_policy;           /* SR_ARPQ_DROP_NEWEST or _OLDEST */
+    size_t queue_budget;        /* Buffer bytes queued over all requests */
+    size_t queued_bytes;
+    uint64_t queue_drops;       /* Packets dropped by queue_max */
+    uint64_t budget_drops;      /* Packets dropped by queue_budget */
+    struct sr_arpneg *neg[SR_ARPNEG_SZ]; /* Negative cache, by IP */
+    uint32_t nneg;
+    uint64_t neg_drops;         /* Packets to dead IPs dropped */
+    uint64_t rate_limited;      /* Requests held back by the buckets */
+    struct sr_arpsend outbox[SR_ARP_OUTBOX]; /* Requests to send once the
+                                   lock is released, [outbox_head, noutbox) */
+    uint32_t outbox_head;
+    uint32_t noutbox;
+    uint32_t gen;               /* Bumped whenever a mapping is added,
+                                   changes or expires, see sr_flowcache.h */
+    uint32_t round;             /* See sr_arpcache_round */
+    struct sr_timer round_timer;
+    uint64_t refreshes;         /* Unicast refreshes sent */
+    uint64_t refresh_saves;     /* Of those, answered before expiry: each
+                                   a miss avoided */
+    struct sr_timer_wheel timers; /* Entry expiries and request retries */
+    uint64_t wake;              /* When the cleanup thread next wakes */
+    pthread_cond_t cond;        /* Wakes it early for a sooner timer */
+    struct sr_instance *sr;     /* Set by the cleanup thread */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -110,26 +255,91 @@ struct sr_arpcache {
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
+/* Copies the MAC for an IP (network byte order) into mac[6] and returns 1,
+   or returns 0 if the IP isn't cached. Lock and allocation free, for the
+   forwarding path. Marks the entry used. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip,
+                           unsigned char *mac);
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+   that corresponds to this ARP request. The packet is kept through
+   sr_mbuf_keep(): a reference to mbuf, the buffer it's in, if that is frame
+   sized, else a copy in one of sr_mbuf_frames(). The packet is dropped
+   rather than queued when the request's queue or the cache's byte budget is
+   full (see above), or when it is too long for a frame buffer.
 
-   A pointer to the ARP request is returned; it should be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+   A pointer to the ARP request is returned; it belongs to the cache and
+   should not be freed, and it stays valid only while the caller holds the
+   cache lock. The caller can remove the ARP request from the queue by
+   calling sr_arpreq_destroy. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
                          unsigned int packet_len,
-                         char *iface);
+                         int ifid,
+                         struct sr_mbuf *mbuf);         /* borrowed */
 
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping in the cache, and marks it valid.
+   ifid is the interface the mapping was learned on, refreshes are sent
+   out of it (SR_IF_NONE: never refreshed). */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip);
+                                     uint32_t ip,
+                                     int ifid);
+
+/* Copies up to max of sr's mappings into out and returns how many, for a
+   warm start snapshot. */
+uint32_t sr_arpcache_export(struct sr_instance *sr, struct sr_arpsnap *out,
+                            uint32_t max);
+
+/* Inserts a mapping from a snapshot that may have gone stale, learned on
+   interface ifid. It is used for forwarding right away, but gets a
+   unicast request verify_ms from now and is removed
+   SR_ARPCACHE_REFRESH_MS later unless that is answered. A mapping already
+   in the cache is left alone. */
+void sr_arpcache_restore(struct sr_arpcache *cache, const struct sr_arpsnap *snap,
+                         int ifid, uint32_t verify_ms);
+
+/* Returns 1 if ip (network byte order) is in the negative cache, counting
+   the packet the caller is about to drop for it, 0 otherwise. */
+int sr_arpcache_unreachable(struct sr_arpcache *cache, uint32_t ip);
+
+/* Makes an ARP request for req out of req->ifid and schedules the next
+   one, or gives up on req once SR_ARPREQ_TRIES have gone unanswered,
+   counting those the rate limit held back, so a request lives at most
+   that many retry intervals either way. Call it once on a new request
+   (tries is 0); the cache's timer calls it
+   after that. Hold the cache lock from sr_arpcache_queuereq until this
+   returns, or the timer may give up on req in between, then release it
+   and call sr_arpcache_send_requests. */
+void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req);
+
+/* Sends the requests handle_arpreq made, see above. Call it without the
+   cache lock held, or the writes happen under it after all. */
+void sr_arpcache_send_requests(struct sr_instance *sr);
+
+/* Sets the limits on packets queued waiting for replies: queue_max per
+   request, dropping per policy (SR_ARPQ_DROP_*) beyond it, and budget
+   bytes over all requests. Packets already queued are left alone. */
+void sr_arpcache_set_queue(struct sr_arpcache *cache, uint32_t queue_max,
+                           int policy, size_t budget);
+
+/* Sets the most mappings the cache will hold before evicting. */
+void sr_arpcache_set_max(struct sr_arpcache *cache, uint32_t max_entries);
+
+/* Returns the current generation of the cache's mappings. Safe to call
+   without holding the lock. */
+uint32_t sr_arpcache_generation(struct sr_arpcache *cache);
+
+/* Returns the current round, which moves on every SR_ARPCACHE_ROUND_MS.
+   Whoever forwards with a MAC kept outside the cache should look it up
+   again with sr_arpcache_lookup_mac once per round, or its entry will
+   look idle and age out. Safe to call without holding the lock. */
+uint32_t sr_arpcache_round(struct sr_arpcache *cache);
 
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
@@ -140,8 +350,8 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
 
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and a cleanup thread runs the cache's timers as they come
+   due. */
 
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
@@ -0,0 +1,224 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_egress.c
+ *
+ * Description:
+ *
+ * Per-interface egress queues for the socket to the server (see
+ * sr_egress.h)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "sr_egress.h"
+#include "sr_router.h"
+
+/* The reader polls backlog without the lock to decide whether to wait for
+   the socket to become writable, so it only changes atomically. */
+static void sr_egress_count(struct sr_egress *e, int n) {
+    __atomic_add_fetch(&(e->backlog), n, __ATOMIC_RELAXED);
+}
+
+static struct sr_egress_frame *sr_egress_pop(struct sr_egress_q *q) {
+    struct sr_egress_frame *f = q->head;
+
+    q->head = f->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+        q->dropping = 0;
+    }
+    q->depth--;
+    return f;
+}
+
+static void sr_egress_free(struct sr_egress_frame *f) {
+    sr_mbuf_put(f->mbuf);
+    sr_pool_free(f);
+}
+
+void sr_egress_init(struct sr_egress *e, uint32_t max, int policy) {
+    memset(e, 0, sizeof(struct sr_egress));
+    sr_mbuf_pool_init(&(e->pool), "egress", sizeof(struct sr_egress_frame),
+                      max);
+    e->max = max;
+    e->policy = policy;
+}
+
+int sr_egress_put(struct sr_egress *e, int ifid, const char *name,
+                  const struct iovec *iov, size_t off, struct sr_mbuf *mbuf)
+{
+    struct sr_egress_q *q = &(e->q[ifid]);
+    struct sr_egress_frame *f;
+
+    if (off == 0 && q->depth >= e->max) {
+        if (!q->dropping) {
+            fprintf(stderr, "Egress %s full (%u frames), dropping %s\n",
+                    name, e->max,
+                    e->policy == SR_EGRESS_DROP_OLDEST ? "oldest" : "newest");
+            q->dropping = 1;
+        }
+        q->dropped++;
+        if (e->policy != SR_EGRESS_DROP_OLDEST)
+            return -1;
+        sr_egress_free(sr_egress_pop(q));
+        q->dropping = 1;
+        sr_egress_count(e, -1);
+    }
+
+    f = (struct sr_egress_frame *)sr_pool_alloc(&(e->pool));
+    if (f == NULL) {
+        fprintf(stderr, "Error: out of memory (sr_egress_put)\n");
+        return -1;
+    }
+    f->next = NULL;
+    f->hlen = iov[0].iov_len;
+    memcpy(f->hdr, iov[0].iov_base, f->hlen);
+    f->len = iov[1].iov_len;
+
+    /* the frame stays where it is only if that's a frame sized buffer,
+       else it is copied (see sr_mbuf.h) */
+    f->buf = iov[1].iov_base;
+    if ((f->mbuf = sr_mbuf_keep(mbuf, &(f->buf), f->len)) == NULL) {
+        q->dropped++;
+        sr_pool_free(f);
+        return -1;
+    }
+    sr_egress_count(e, 1);
+
+    if (off) {
+        e->part = f;
+        e->part_off = off;
+        return 0;
+    }
+
+    if (q->tail)
+        q->tail->next = f;
+    else
+        q->head = f;
+    q->tail = f;
+    q->depth++;
+    q->queued++;
+    if (q->depth > q->peak)
+        q->peak = q->depth;
+    return 0;
+}
+
+/* Points iov at what is left of f from off on, one or two entries. */
+static int sr_egress_iov(struct iovec *iov, struct sr_egress_frame *f,
+                         unsigned int off)
+{
+    int n = 0;
+
+    if (off < f->hlen) {
+        iov[n].iov_base = f->hdr + off;
+        iov[n++].iov_len = f->hlen - off;
+        off = 0;
+    } else
+        off -= f->hlen;
+    iov[n].iov_base = f->buf + off;
+    iov[n++].iov_len = f->len - off;
+    return n;
+}
+
+int sr_egress_drain(struct sr_egress *e, int fd) {
+    struct iovec iov[2 * SR_TXQ_MAX];
+    int from[SR_TXQ_MAX];       /* Queue each came off, -1 the partial one */
+    size_t left[SR_TXQ_MAX];    /* Bytes of each still to write */
+    struct sr_egress_frame *f;
+    struct sr_egress_frame *cursor[SR_IF_MAX];
+    ssize_t written;
+    int i, n = 0, niov = 0, done = 0, more = 1;
+
+    if (e->part) {
+        niov += sr_egress_iov(iov + niov, e->part, e->part_off);
+        left[n] = e->part->hlen + e->part->len - e->part_off;
+        from[n++] = -1;
+    }
+
+    /* whole frames, one from each queue in turn */
+    for (i = 0; i < SR_IF_MAX; i++)
+        cursor[i] = e->q[i].head;
+    while (more && n < SR_TXQ_MAX) {
+        more = 0;
+        for (i = 0; i < SR_IF_MAX && n < SR_TXQ_MAX; i++) {
+            int qi = (e->next + i) % SR_IF_MAX;
+            if ((f = cursor[qi]) == NULL)
+                continue;
+            niov += sr_egress_iov(iov + niov, f, 0);
+            left[n] = f->hlen + f->len;
+            from[n++] = qi;
+            cursor[qi] = f->next;
+            more = 1;
+        }
+    }
+    e->next = (e->next + 1) % SR_IF_MAX;
+    if (n == 0)
+        return 0;
+
+    do {
+        written = writev(fd, iov, niov);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        perror("writev(..):sr_egress.c::sr_egress_drain");
+        sr_egress_clear(e);
+        return -1;
+    }
+
+    /* frames go in order, each is the head of its queue by now */
+    for (i = 0; i < n && written > 0; i++) {
+        f = (from[i] < 0) ? e->part : e->q[from[i]].head;
+        if ((size_t)written < left[i]) {
+            if (from[i] < 0) {
+                e->part_off += written;
+            } else {
+                e->part = sr_egress_pop(&(e->q[from[i]]));
+                e->part_off = written;
+            }
+            break;
+        }
+        written -= left[i];
+        if (from[i] < 0)
+            e->part = NULL;
+        else
+            sr_egress_pop(&(e->q[from[i]]));
+        sr_egress_free(f);
+        sr_egress_count(e, -1);
+        done++;
+    }
+    return done;
+}
+
+void sr_egress_clear(struct sr_egress *e) {
+    int i;
+
+    if (e->part) {
+        sr_egress_free(e->part);
+        e->part = NULL;
+        sr_egress_count(e, -1);
+    }
+    for (i = 0; i < SR_IF_MAX; i++) {
+        while (e->q[i].head) {
+            sr_egress_free(sr_egress_pop(&(e->q[i])));
+            e->q[i].dropped++;
+            sr_egress_count(e, -1);
+        }
+    }
+}
+
+void sr_egress_dump(const struct sr_egress *e, struct sr_if *const *ifs,
+                    int nifs)
+{
+    int i;
+
+    for (i = 0; i < nifs; i++) {
+        const struct sr_egress_q *q = &(e->q[ifs[i]->id]);
+        fprintf(stderr, "Egress %s: %u queued now (peak %u of %u), "
+                "%lu waited, %lu dropped\n", ifs[i]->name, q->depth, q->peak,
+                e->max, q->queued, q->dropped);
+    }
+}
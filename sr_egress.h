@@ -0,0 +1,102 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_egress.h
+ *
+ * Description:
+ *
+ * Per-interface egress queues for frames the server isn't ready to take.
+ *
+ * The socket to the server is non-blocking.  As long as it takes whatever
+ * is written to it frames go straight out of the transmit queue (see
+ * struct sr_txq) without touching these.  When a write comes up short
+ * what wasn't written moves here: the rest of a frame the server has
+ * started on as the partial frame, which always goes out first, and each
+ * whole frame onto the queue of the interface it is for, kept through
+ * sr_mbuf_keep(): a frame in a frame sized buffer stays there, one in a
+ * receive buffer or in none is copied into one (see sr_mbuf.h).  From
+ * then on new frames queue behind them until the reader finds the socket writable
+ * again and drains the queues, taking turns between interfaces.
+ *
+ * Each queue holds at most max frames.  A frame for a full queue is
+ * dropped, or the oldest queued one makes room for it, depending on the
+ * policy.  Depth, peak depth and drops are kept per interface.
+ *
+ * Callers serialise access (send_lock).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_EGRESS_H
+#define SR_EGRESS_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif
+
+#include <sys/uio.h>
+
+#include "sr_if.h"
+#include "sr_mbuf.h"
+
+#define SR_EGRESS_QLEN 256 /* frames queued per interface by default */
+
+#define SR_EGRESS_DROP_NEWEST 0
+#define SR_EGRESS_DROP_OLDEST 1
+
+#define SR_EGRESS_HDR 32   /* room for a VNS packet header */
+
+struct sr_egress_frame {
+    struct sr_egress_frame* next;
+    uint8_t hdr[SR_EGRESS_HDR]; /* VNS header */
+    unsigned int hlen;
+    uint8_t* buf;               /* Ethernet frame */
+    unsigned int len;
+    struct sr_mbuf* mbuf;       /* buf is in it, a reference is held */
+};
+
+struct sr_egress_q {
+    struct sr_egress_frame* head;
+    struct sr_egress_frame* tail;
+    uint32_t depth;
+    uint32_t peak;
+    unsigned long queued;       /* Frames that ever had to wait here */
+    unsigned long dropped;
+    int dropping;               /* Full since it was last empty */
+};
+
+struct sr_egress {
+    struct sr_egress_q q[SR_IF_MAX];
+    struct sr_egress_frame* part; /* Started on, the rest goes first */
+    unsigned int part_off;
+    struct sr_mbuf_pool pool;   /* struct sr_egress_frame */
+    uint32_t max;               /* Frames per queue */
+    int policy;                 /* SR_EGRESS_DROP_NEWEST or _OLDEST */
+    uint32_t backlog;           /* Frames waiting, the partial one too */
+    int next;                   /* Queue the next drain starts with */
+};
+
+void sr_egress_init(struct sr_egress* e, uint32_t max, int policy);
+
+/* Puts the frame in iov[0..1] (VNS header, Ethernet frame) onto ifid's
+   queue, or as the partial frame if the first off bytes of it have been
+   written.  mbuf is the buffer the Ethernet frame is in, 0 if none.  name
+   is the interface's, for the warning that its queue is full.  Returns 0
+   if it was queued, -1 if it was dropped. */
+int sr_egress_put(struct sr_egress* e, int ifid, const char* name,
+                  const struct iovec* iov, size_t off, struct sr_mbuf* mbuf);
+
+/* Writes as much of the backlog to fd as it takes in one writev.
+   Returns the frames completed, or -1 if the write failed; the backlog
+   is thrown away then. */
+int sr_egress_drain(struct sr_egress* e, int fd);
+
+/* Throws away the whole backlog. */
+void sr_egress_clear(struct sr_egress* e);
+
+/* Prints the counters of each interface in ifs. */
+void sr_egress_dump(const struct sr_egress* e, struct sr_if* const* ifs,
+                    int nifs);
+
+#endif /* SR_EGRESS_H */
@@ -0,0 +1,127 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.c
+ *
+ * Description:
+ *
+ * Epoch based reclamation (see sr_epoch.h)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sched.h>
+
+#include "sr_epoch.h"
+
+/* -- slots are numbered per thread, shared by every sr_epoch -- */
+static __thread int sr_epoch_tid = -1;
+static int sr_epoch_nthreads = 0;
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_self(..)
+ * Scope: Local
+ *
+ * This thread's slot number, handing out a new one on first use
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_epoch_self(void)
+{
+    if(sr_epoch_tid < 0)
+    {
+        sr_epoch_tid = __atomic_fetch_add(&sr_epoch_nthreads, 1,
+                                          __ATOMIC_SEQ_CST);
+        if(sr_epoch_tid >= SR_EPOCH_MAX_THREADS)
+        {
+            fprintf(stderr, "Error: more than %d epoch reader threads\n",
+                    SR_EPOCH_MAX_THREADS);
+            abort();
+        }
+    }
+    return sr_epoch_tid;
+} /* -- sr_epoch_self -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_init(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_epoch_init(struct sr_epoch* e)
+{
+    assert(e);
+
+    memset(e, 0, sizeof(struct sr_epoch));
+    e->global = 1; /* -- 0 marks a slot as outside -- */
+} /* -- sr_epoch_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_enter(..)
+ * Scope: Global
+ *
+ * Start a read section.  Pointers loaded after this stay valid until the
+ * matching sr_epoch_exit().  Sections may nest.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_epoch_enter(struct sr_epoch* e)
+{
+    struct sr_epoch_slot* slot = &e->slots[sr_epoch_self()];
+
+    if(slot->depth++ == 0)
+    {
+        /* -- seq_cst store so it is visible before we load any pointer -- */
+        __atomic_store_n(&slot->epoch,
+                         __atomic_load_n(&e->global, __ATOMIC_ACQUIRE),
+                         __ATOMIC_SEQ_CST);
+    }
+} /* -- sr_epoch_enter -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_exit(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_epoch_exit(struct sr_epoch* e)
+{
+    struct sr_epoch_slot* slot = &e->slots[sr_epoch_self()];
+
+    assert(slot->depth > 0);
+    if(--slot->depth == 0)
+    { __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE); }
+} /* -- sr_epoch_exit -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_epoch_synchronize(..)
+ * Scope: Global
+ *
+ * Wait until every read section that started before this call has
+ * ended.  Anything unpublished before the call may then be freed.  Must
+ * not be called from inside a read section.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_epoch_synchronize(struct sr_epoch* e)
+{
+    uint64_t target, seen;
+    int i, n;
+
+    target = __atomic_add_fetch(&e->global, 1, __ATOMIC_SEQ_CST);
+    n = __atomic_load_n(&sr_epoch_nthreads, __ATOMIC_ACQUIRE);
+    if(n > SR_EPOCH_MAX_THREADS)
+    { n = SR_EPOCH_MAX_THREADS; }
+
+    for(i = 0; i < n; i++)
+    {
+        for(;;)
+        {
+            seen = __atomic_load_n(&e->slots[i].epoch, __ATOMIC_ACQUIRE);
+            if(seen == 0 || seen >= target)
+            { break; }
+            sched_yield();
+        }
+    }
+} /* -- sr_epoch_synchronize -- */
@@ -0,0 +1,57 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.h
+ *
+ * Description:
+ *
+ * Epoch based reclamation for data that is read without locks.  Readers
+ * bracket their accesses with sr_epoch_enter()/sr_epoch_exit(), which only
+ * store to a per-thread slot.  A writer swaps in a new version with an
+ * atomic pointer store, calls sr_epoch_synchronize() to wait until every
+ * reader that might still hold the old version has left its read section,
+ * and then frees the old version.  Readers never block or retry.
+ *
+ * Threads get a slot the first time they enter; at most
+ * SR_EPOCH_MAX_THREADS threads may ever read.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_EPOCH_H
+#define sr_EPOCH_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif
+
+#define SR_EPOCH_MAX_THREADS 64
+
+/* ----------------------------------------------------------------------------
+ * struct sr_epoch_slot
+ *
+ * Per thread state, padded out to a cache line so readers on different
+ * threads never share one
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_epoch_slot
+{
+    uint64_t epoch;   /* epoch the thread entered in, 0 while outside */
+    uint32_t depth;   /* nesting of enter calls, owner thread only */
+    char     pad[64 - sizeof(uint64_t) - sizeof(uint32_t)];
+};
+
+struct sr_epoch
+{
+    uint64_t global;
+    struct sr_epoch_slot slots[SR_EPOCH_MAX_THREADS];
+};
+
+void sr_epoch_init(struct sr_epoch*);
+void sr_epoch_enter(struct sr_epoch*);
+void sr_epoch_exit(struct sr_epoch*);
+void sr_epoch_synchronize(struct sr_epoch*);
+
+#endif  /* --  sr_EPOCH_H -- */
@@ -0,0 +1,1053 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.c
+ *
+ * Description:
+ *
+ * Longest prefix match engines over the routing table (see sr_fib.h)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_fib.h"
+#include "sr_arena.h"
+
+#define SR_FIB_SLOT_MASK (SR_FIB_FANOUT - 1)
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_node_alloc(..)
+ * Scope: Local
+ *
+ * Append an empty node to the node array and return its index, or 0 if
+ * we ran out of memory (0 is the root, so it is never a valid child).
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_fib_node_alloc(struct sr_fib* fib)
+{
+    struct sr_fib_node* nodes = 0;
+    uint32_t cap = 0;
+
+    if(fib->nnodes == fib->nodes_cap)
+    {
+        cap = fib->nodes_cap ? fib->nodes_cap * 2 : 64;
+        nodes = (struct sr_fib_node*)sr_arena_realloc(fib->nodes,
+                    (size_t)fib->nodes_cap * sizeof(struct sr_fib_node),
+                    (size_t)cap * sizeof(struct sr_fib_node),
+                    "FIB", "trie nodes");
+        if(nodes == 0)
+        { return 0; }
+        fib->nodes = nodes;
+        fib->nodes_cap = cap;
+    }
+
+    memset(&fib->nodes[fib->nnodes], 0, sizeof(struct sr_fib_node));
+    return fib->nnodes++;
+} /* -- sr_fib_node_alloc -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_tbl8_alloc(..)
+ * Scope: Local
+ *
+ * Append a DIR-24-8 second level group with every slot set to 'fill' and
+ * return its index, or -1 if we ran out of memory.
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_tbl8_alloc(struct sr_fib* fib, uint32_t fill)
+{
+    uint32_t* tbl8 = 0;
+    uint32_t* group = 0;
+    uint32_t cap = 0;
+    int i;
+
+    if(fib->ntbl8 == SR_FIB_LEAF_MASK)
+    { return -1; }
+
+    if(fib->ntbl8 == fib->tbl8_cap)
+    {
+        cap = fib->tbl8_cap ? fib->tbl8_cap * 2 : 64;
+        tbl8 = (uint32_t*)sr_arena_realloc(fib->tbl8,
+                    (size_t)fib->tbl8_cap * SR_DIR24_TBL8_SZ * sizeof(uint32_t),
+                    (size_t)cap * SR_DIR24_TBL8_SZ * sizeof(uint32_t),
+                    "FIB", "tbl8");
+        if(tbl8 == 0)
+        { return -1; }
+        fib->tbl8 = tbl8;
+        fib->tbl8_cap = cap;
+    }
+
+    group = &fib->tbl8[(size_t)fib->ntbl8 * SR_DIR24_TBL8_SZ];
+    for(i = 0; i < SR_DIR24_TBL8_SZ; i++)
+    { group[i] = fill; }
+
+    return fib->ntbl8++;
+} /* -- sr_fib_tbl8_alloc -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_create(..)
+ * Scope: Global
+ *
+ * Allocate an empty table for the given engine
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_create(int engine)
+{
+    struct sr_fib* fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+    size_t len = (size_t)SR_DIR24_TBL24_SZ * sizeof(uint32_t);
+
+    if(fib == 0)
+    { return 0; }
+
+    fib->engine = engine;
+
+    if(engine == SR_FIB_DIR24)
+    {
+        /* -- mapped, so untouched parts of the table cost no memory -- */
+        fib->tbl24 = (uint32_t*)sr_arena_alloc(&len, "FIB", "tbl24");
+        if(fib->tbl24 == 0)
+        {
+            free(fib);
+            return 0;
+        }
+        return fib;
+    }
+
+    fib->engine = SR_FIB_TRIE;
+    sr_fib_node_alloc(fib);
+    if(fib->nnodes != 1)
+    {
+        free(fib);
+        return 0;
+    }
+
+    return fib;
+} /* -- sr_fib_create -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_destroy(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_destroy(struct sr_fib* fib)
+{
+    if(fib == 0)
+    { return; }
+
+    if(fib->map)
+    {
+        munmap(fib->map, fib->map_len);
+        free(fib);
+        return;
+    }
+
+    free(fib->routes);
+    free(fib->nhs);
+    free(fib->nh_hash);
+    sr_arena_free(fib->nodes);
+    sr_arena_free(fib->tbl24);
+    sr_arena_free(fib->tbl8);
+    free(fib);
+} /* -- sr_fib_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_mask_len(..)
+ * Scope: Global
+ *
+ * Number of leading one bits in a netmask.  Anything after the first zero
+ * bit of a non-contiguous mask is ignored.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_mask_len(uint32_t mask_nbo)
+{
+    uint32_t mask = ntohl(mask_nbo);
+    int len = 0;
+
+    while(len < 32 && (mask & (0x80000000u >> len)))
+    { len++; }
+
+    return len;
+} /* -- sr_fib_mask_len -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_leaf_replace(..)
+ * Scope: Local
+ *
+ * A slot is only overwritten by a prefix at least as long as the one it
+ * already holds, so routes may be inserted in any order; on a tie the
+ * later route wins.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_leaf_replace(uint32_t* slot, uint32_t leaf, int len)
+{
+    if(*slot == 0 || SR_FIB_LEAF_DEPTH(*slot) <= (uint32_t)len)
+    { *slot = leaf; }
+} /* -- sr_fib_leaf_replace -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_trie_insert(..)
+ * Scope: Local
+ *
+ * Walk (and grow) the trie down to the node the prefix ends in, then
+ * expand the remaining bits over the slots they cover.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_trie_insert(struct sr_fib* fib, uint32_t prefix, int len,
+                              uint32_t leaf)
+{
+    uint32_t node, child, slot, span, shift, i;
+    int depth;
+
+    node  = 0;
+    shift = 32 - SR_FIB_STRIDE;
+    depth = len;
+    while(depth > SR_FIB_STRIDE)
+    {
+        slot = (prefix >> shift) & SR_FIB_SLOT_MASK;
+        if(fib->nodes[node].child[slot] == 0)
+        {
+            if((child = sr_fib_node_alloc(fib)) == 0)
+            { return -1; }
+            fib->nodes[node].child[slot] = child;
+        }
+        node   = fib->nodes[node].child[slot];
+        shift -= SR_FIB_STRIDE;
+        depth -= SR_FIB_STRIDE;
+    }
+
+    span = 1u << (SR_FIB_STRIDE - depth);
+    slot = (prefix >> shift) & SR_FIB_SLOT_MASK & ~(span - 1);
+    for(i = slot; i < slot + span; i++)
+    { sr_fib_leaf_replace(&fib->nodes[node].leaf[i], leaf, len); }
+
+    return 0;
+} /* -- sr_fib_trie_insert -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_dir24_insert(..)
+ * Scope: Local
+ *
+ * Prefixes up to /24 fill a range of first level entries, pushing down
+ * into any second level group already hanging off them.  Longer prefixes
+ * first split their /24 into a group inheriting the /24's current route.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_dir24_insert(struct sr_fib* fib, uint32_t prefix, int len,
+                               uint32_t leaf)
+{
+    uint32_t* group = 0;
+    uint32_t first, count, i, j;
+    int32_t idx;
+
+    if(len <= 24)
+    {
+        first = prefix >> 8;
+        count = 1u << (24 - len);
+        for(i = first; i < first + count; i++)
+        {
+            if(fib->tbl24[i] & SR_FIB_LEAF_EXT)
+            {
+                group = &fib->tbl8[(size_t)(fib->tbl24[i] & SR_FIB_LEAF_MASK) *
+                                   SR_DIR24_TBL8_SZ];
+                for(j = 0; j < SR_DIR24_TBL8_SZ; j++)
+                { sr_fib_leaf_replace(&group[j], leaf, len); }
+            }
+            else
+            { sr_fib_leaf_replace(&fib->tbl24[i], leaf, len); }
+        }
+        return 0;
+    }
+
+    i = prefix >> 8;
+    if(!(fib->tbl24[i] & SR_FIB_LEAF_EXT))
+    {
+        if((idx = sr_fib_tbl8_alloc(fib, fib->tbl24[i])) < 0)
+        { return -1; }
+        fib->tbl24[i] = SR_FIB_LEAF_EXT | (uint32_t)idx;
+    }
+
+    group = &fib->tbl8[(size_t)(fib->tbl24[i] & SR_FIB_LEAF_MASK) *
+                       SR_DIR24_TBL8_SZ];
+    first = prefix & 0xff;
+    count = 1u << (32 - len);
+    for(j = first; j < first + count; j++)
+    { sr_fib_leaf_replace(&group[j], leaf, len); }
+
+    return 0;
+} /* -- sr_fib_dir24_insert -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_nh_hash(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------*/
+
+static uint32_t sr_fib_nh_hash(struct in_addr gw, const char* interface)
+{
+    uint32_t h = 2166136261u ^ gw.s_addr;
+    int i;
+
+    /* -- FNV-1a over the name -- */
+    for(i = 0; i < sr_IFACE_NAMELEN && interface[i]; i++)
+    { h = (h ^ (uint8_t)interface[i]) * 16777619u; }
+
+    return h * 2654435761u;
+} /* -- sr_fib_nh_hash -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_nh_rehash(..)
+ * Scope: Local
+ *
+ * Grow the next hop hash to sz slots (a power of two).  Returns 0 on
+ * success.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_nh_rehash(struct sr_fib* fib, uint32_t sz)
+{
+    uint32_t* hash = (uint32_t*)calloc(sz, sizeof(uint32_t));
+    uint32_t i, slot;
+
+    if(hash == 0)
+    { return -1; }
+
+    for(i = 0; i < fib->nnhs; i++)
+    {
+        slot = sr_fib_nh_hash(fib->nhs[i].gw, fib->nhs[i].interface) & (sz - 1);
+        while(hash[slot])
+        { slot = (slot + 1) & (sz - 1); }
+        hash[slot] = i + 1;
+    }
+
+    free(fib->nh_hash);
+    fib->nh_hash = hash;
+    fib->nh_hash_sz = sz;
+    return 0;
+} /* -- sr_fib_nh_rehash -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_nh_get(..)
+ * Scope: Local
+ *
+ * Index of the next hop for a route's gateway and interface, adding it
+ * if this is the first route through them.  Returns -1 if out of memory.
+ *
+ *---------------------------------------------------------------------*/
+
+static int32_t sr_fib_nh_get(struct sr_fib* fib, const struct sr_rt* entry)
+{
+    struct sr_fib_nh* nhs = 0;
+    struct sr_fib_nh* nh = 0;
+    uint32_t slot, cap;
+
+    if(fib->nnhs * 2 >= fib->nh_hash_sz &&
+       sr_fib_nh_rehash(fib, fib->nh_hash_sz ? fib->nh_hash_sz * 2 : 64) != 0)
+    { return -1; }
+
+    slot = sr_fib_nh_hash(entry->gw, entry->interface) & (fib->nh_hash_sz - 1);
+    while(fib->nh_hash[slot])
+    {
+        nh = &fib->nhs[fib->nh_hash[slot] - 1];
+        if(nh->gw.s_addr == entry->gw.s_addr &&
+           strncmp(nh->interface, entry->interface, sr_IFACE_NAMELEN) == 0)
+        { return fib->nh_hash[slot] - 1; }
+        slot = (slot + 1) & (fib->nh_hash_sz - 1);
+    }
+
+    if(fib->nnhs == SR_FIB_MAX_NHS)
+    { return -1; }
+
+    if(fib->nnhs == fib->nhs_cap)
+    {
+        cap = fib->nhs_cap ? fib->nhs_cap * 2 : 16;
+        nhs = (struct sr_fib_nh*)realloc(fib->nhs,
+                                    (size_t)cap * sizeof(struct sr_fib_nh));
+        if(nhs == 0)
+        { return -1; }
+        fib->nhs = nhs;
+        fib->nhs_cap = cap;
+    }
+
+    nh = &fib->nhs[fib->nnhs];
+    memset(nh, 0, sizeof(struct sr_fib_nh));
+    nh->gw = entry->gw;
+    memcpy(nh->interface, entry->interface, sr_IFACE_NAMELEN - 1);
+    fib->nh_hash[slot] = fib->nnhs + 1;
+
+    return fib->nnhs++;
+} /* -- sr_fib_nh_get -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_insert(..)
+ * Scope: Global
+ *
+ * Copy the route into the table and add its prefix to the lookup
+ * structure, sharing the next hop of any earlier route through the same
+ * gateway and interface.
+ *
+ * Returns 0 on success, -1 if out of memory or the table is a mapped
+ * image.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_insert(struct sr_fib* fib, const struct sr_rt* entry)
+{
+    struct sr_fib_route* routes = 0;
+    struct sr_fib_route* route = 0;
+    uint32_t prefix, leaf, cap;
+    int32_t nh;
+    int len, ret;
+
+    /* -- REQUIRES -- */
+    assert(fib);
+    assert(entry);
+
+    if(fib->map)
+    { return -1; }
+
+    if(fib->nroutes == fib->routes_cap)
+    {
+        cap = fib->routes_cap ? fib->routes_cap * 2 : 64;
+        routes = (struct sr_fib_route*)realloc(fib->routes,
+                                    (size_t)cap * sizeof(struct sr_fib_route));
+        if(routes == 0)
+        { return -1; }
+        fib->routes = routes;
+        fib->routes_cap = cap;
+    }
+
+    if((nh = sr_fib_nh_get(fib, entry)) < 0)
+    { return -1; }
+
+    len = sr_fib_mask_len(entry->mask.s_addr);
+    prefix = len ? ntohl(entry->dest.s_addr) & (0xffffffffu << (32 - len)) : 0;
+    leaf = SR_FIB_LEAF(len, nh);
+
+    if(fib->engine == SR_FIB_DIR24)
+    { ret = sr_fib_dir24_insert(fib, prefix, len, leaf); }
+    else
+    { ret = sr_fib_trie_insert(fib, prefix, len, leaf); }
+
+    if(ret != 0)
+    { return ret; }
+
+    route = &fib->routes[fib->nroutes++];
+    memset(route, 0, sizeof(struct sr_fib_route));
+    route->dest = entry->dest;
+    route->mask = entry->mask;
+    route->nh   = nh;
+
+    return 0;
+} /* -- sr_fib_insert -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_find(..)
+ * Scope: Global
+ *
+ * Longest prefix match for an address in network byte order.  Returns the
+ * next hop of the matching route or 0 if nothing (not even a default
+ * route) matches.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib_nh* sr_fib_find(const struct sr_fib* fib, uint32_t ip_nbo)
+{
+    const struct sr_fib_node* node = 0;
+    uint32_t addr = ntohl(ip_nbo);
+    uint32_t best = 0;
+    uint32_t shift = 32 - SR_FIB_STRIDE;
+    uint32_t slot;
+
+    if(fib == 0)
+    { return 0; }
+
+    if(fib->engine == SR_FIB_DIR24)
+    {
+        best = fib->tbl24[addr >> 8];
+        if(best & SR_FIB_LEAF_EXT)
+        {
+            best = fib->tbl8[(size_t)(best & SR_FIB_LEAF_MASK) *
+                             SR_DIR24_TBL8_SZ + (addr & 0xff)];
+        }
+        return best ? &fib->nhs[SR_FIB_LEAF_INDEX(best)] : 0;
+    }
+
+    node = fib->nodes;
+    for(;;)
+    {
+        slot = (addr >> shift) & SR_FIB_SLOT_MASK;
+        if(node->leaf[slot])
+        { best = node->leaf[slot]; }
+        if(node->child[slot] == 0)
+        { break; }
+        node   = &fib->nodes[node->child[slot]];
+        shift -= SR_FIB_STRIDE;
+    }
+
+    return best ? &fib->nhs[SR_FIB_LEAF_INDEX(best)] : 0;
+} /* -- sr_fib_find -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_trie_find_group(..)
+ * Scope: Local
+ *
+ * Walk up to SR_FIB_BULK lookups down the trie in lock step.  The next
+ * node of every lane is prefetched before any of them is read, so the
+ * cache misses of one level overlap instead of being paid one by one.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_trie_find_group(const struct sr_fib* fib,
+                                   const uint32_t* ip_nbo, int n,
+                                   struct sr_fib_nh** out)
+{
+    const struct sr_fib_node* node[SR_FIB_BULK];
+    uint32_t addr[SR_FIB_BULK];
+    uint32_t best[SR_FIB_BULK];
+    uint32_t shift = 32 - SR_FIB_STRIDE;
+    uint32_t slot;
+    int i, active = n;
+
+    for(i = 0; i < n; i++)
+    {
+        addr[i] = ntohl(ip_nbo[i]);
+        best[i] = 0;
+        node[i] = fib->nodes;
+    }
+
+    while(active)
+    {
+        active = 0;
+        for(i = 0; i < n; i++)
+        {
+            if(node[i] == 0)
+            { continue; }
+            slot = (addr[i] >> shift) & SR_FIB_SLOT_MASK;
+            if(node[i]->leaf[slot])
+            { best[i] = node[i]->leaf[slot]; }
+            if(node[i]->child[slot] == 0)
+            {
+                node[i] = 0;
+                continue;
+            }
+            node[i] = &fib->nodes[node[i]->child[slot]];
+            __builtin_prefetch(node[i]);
+            active++;
+        }
+        shift -= SR_FIB_STRIDE;
+    }
+
+    for(i = 0; i < n; i++)
+    { out[i] = best[i] ? &fib->nhs[SR_FIB_LEAF_INDEX(best[i])] : 0; }
+} /* -- sr_fib_trie_find_group -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_dir24_find_group(..)
+ * Scope: Local
+ *
+ * Same idea for DIR-24-8: prefetch every first level entry, then every
+ * second level entry the group needs, then resolve.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_fib_dir24_find_group(const struct sr_fib* fib,
+                                    const uint32_t* ip_nbo, int n,
+                                    struct sr_fib_nh** out)
+{
+    uint32_t addr[SR_FIB_BULK];
+    uint32_t entry[SR_FIB_BULK];
+    const uint32_t* tbl8[SR_FIB_BULK];
+    int i;
+
+    for(i = 0; i < n; i++)
+    {
+        addr[i] = ntohl(ip_nbo[i]);
+        __builtin_prefetch(&fib->tbl24[addr[i] >> 8]);
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        entry[i] = fib->tbl24[addr[i] >> 8];
+        tbl8[i] = 0;
+        if(entry[i] & SR_FIB_LEAF_EXT)
+        {
+            tbl8[i] = &fib->tbl8[(size_t)(entry[i] & SR_FIB_LEAF_MASK) *
+                                 SR_DIR24_TBL8_SZ + (addr[i] & 0xff)];
+            __builtin_prefetch(tbl8[i]);
+        }
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        if(tbl8[i])
+        { entry[i] = *tbl8[i]; }
+        out[i] = entry[i] ? &fib->nhs[SR_FIB_LEAF_INDEX(entry[i])] : 0;
+    }
+} /* -- sr_fib_dir24_find_group -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_find_bulk(..)
+ * Scope: Global
+ *
+ * sr_fib_find() for n addresses at once, out[i] receiving the match for
+ * ip_nbo[i].  Addresses are resolved SR_FIB_BULK at a time with their
+ * memory accesses interleaved.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_find_bulk(const struct sr_fib* fib, const uint32_t* ip_nbo, int n,
+                      struct sr_fib_nh** out)
+{
+    int i, group;
+
+    /* -- REQUIRES -- */
+    assert(ip_nbo || n == 0);
+    assert(out || n == 0);
+
+    if(fib == 0)
+    {
+        for(i = 0; i < n; i++)
+        { out[i] = 0; }
+        return;
+    }
+
+    for(i = 0; i < n; i += SR_FIB_BULK)
+    {
+        group = n - i < SR_FIB_BULK ? n - i : SR_FIB_BULK;
+        if(fib->engine == SR_FIB_DIR24)
+        { sr_fib_dir24_find_group(fib, ip_nbo + i, group, out + i); }
+        else
+        { sr_fib_trie_find_group(fib, ip_nbo + i, group, out + i); }
+    }
+} /* -- sr_fib_find_bulk -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_route_get(..)
+ * Scope: Global
+ *
+ * Fill in out with the i'th route added to the table
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_route_get(const struct sr_fib* fib, uint32_t i, struct sr_rt* out)
+{
+    const struct sr_fib_nh* nh = 0;
+
+    /* -- REQUIRES -- */
+    assert(fib);
+    assert(i < fib->nroutes);
+    assert(out);
+
+    nh = &fib->nhs[fib->routes[i].nh];
+    memset(out, 0, sizeof(struct sr_rt));
+    out->dest = fib->routes[i].dest;
+    out->gw   = nh->gw;
+    out->mask = fib->routes[i].mask;
+    memcpy(out->interface, nh->interface, sr_IFACE_NAMELEN);
+} /* -- sr_fib_route_get -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_memory(..)
+ * Scope: Global
+ *
+ * Bytes allocated for the route copies and the lookup structure
+ *
+ *---------------------------------------------------------------------*/
+
+size_t sr_fib_memory(const struct sr_fib* fib)
+{
+    size_t bytes = 0;
+
+    if(fib == 0)
+    { return 0; }
+
+    if(fib->map)
+    { return fib->map_len; }
+
+    bytes += sizeof(struct sr_fib);
+    bytes += (size_t)fib->routes_cap * sizeof(struct sr_fib_route);
+    bytes += (size_t)fib->nhs_cap * sizeof(struct sr_fib_nh);
+    bytes += (size_t)fib->nh_hash_sz * sizeof(uint32_t);
+    bytes += (size_t)fib->nodes_cap * sizeof(struct sr_fib_node);
+    if(fib->tbl24)
+    { bytes += (size_t)SR_DIR24_TBL24_SZ * sizeof(uint32_t); }
+    bytes += (size_t)fib->tbl8_cap * SR_DIR24_TBL8_SZ * sizeof(uint32_t);
+
+    return bytes;
+} /* -- sr_fib_memory -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_report(..)
+ * Scope: Global
+ *
+ * Print the engine, size, memory footprint and build time of the table
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_report(const struct sr_fib* fib)
+{
+    if(fib == 0)
+    {
+        printf(" *warning* Forwarding table empty \n");
+        return;
+    }
+
+    printf("FIB engine %s: %u routes, %u next hops, ",
+           sr_fib_engine_name(fib->engine), fib->nroutes, fib->nnhs);
+    if(fib->engine == SR_FIB_DIR24)
+    { printf("%u tbl8 groups, ", fib->ntbl8); }
+    else
+    { printf("%u trie nodes, ", fib->nnodes); }
+    printf("%.2f MB, %s in %.3f s\n",
+           sr_fib_memory(fib) / (1024.0 * 1024.0),
+           fib->map ? "mapped" : "built", fib->build_usec / 1e6);
+} /* -- sr_fib_report -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_align(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------*/
+
+static uint64_t sr_fib_image_align(uint64_t off)
+{
+    return (off + SR_FIB_IMAGE_ALIGN - 1) & ~(uint64_t)(SR_FIB_IMAGE_ALIGN - 1);
+} /* -- sr_fib_image_align -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_write(..)
+ * Scope: Local
+ *
+ * Write len bytes at offset off.  Blocks that are all zero are skipped
+ * and left as holes, which keeps the mostly empty DIR-24-8 first level
+ * from taking 64MB of disk.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_image_write(FILE* fp, uint64_t off, const void* data,
+                              size_t len)
+{
+    static const char zero[SR_FIB_IMAGE_ALIGN];
+    const char* p = (const char*)data;
+    size_t chunk;
+
+    while(len)
+    {
+        chunk = len < SR_FIB_IMAGE_ALIGN ? len : SR_FIB_IMAGE_ALIGN;
+        if(memcmp(p, zero, chunk) != 0)
+        {
+            if(fseeko(fp, (off_t)off, SEEK_SET) != 0 ||
+               fwrite(p, chunk, 1, fp) != 1)
+            { return -1; }
+        }
+        p   += chunk;
+        off += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+} /* -- sr_fib_image_write -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_save(..)
+ * Scope: Global
+ *
+ * Write the table as a binary image that sr_fib_map can load.  The image
+ * is written next to filename and renamed over it, so a router that has
+ * the old image mapped keeps a consistent copy.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_save(const struct sr_fib* fib, const char* filename)
+{
+    struct sr_fib_image hdr;
+    char* tmp = 0;
+    FILE* fp = 0;
+    int ret = 0;
+
+    /* -- REQUIRES -- */
+    assert(fib);
+    assert(filename);
+
+    memset(&hdr, 0, sizeof(struct sr_fib_image));
+    memcpy(hdr.magic, SR_FIB_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version    = SR_FIB_IMAGE_VERSION;
+    hdr.byte_order = SR_FIB_IMAGE_ORDER;
+    hdr.rt_size    = sizeof(struct sr_fib_route);
+    hdr.nh_size    = sizeof(struct sr_fib_nh);
+    hdr.engine     = fib->engine;
+    hdr.nroutes    = fib->nroutes;
+    hdr.nnhs       = fib->nnhs;
+    hdr.routes_off = sr_fib_image_align(sizeof(struct sr_fib_image));
+    hdr.nhs_off    = sr_fib_image_align(hdr.routes_off +
+                        (uint64_t)fib->nroutes * sizeof(struct sr_fib_route));
+    hdr.size       = hdr.nhs_off +
+                     (uint64_t)fib->nnhs * sizeof(struct sr_fib_nh);
+    if(fib->engine == SR_FIB_DIR24)
+    {
+        hdr.ntbl8     = fib->ntbl8;
+        hdr.tbl24_off = sr_fib_image_align(hdr.size);
+        hdr.tbl8_off  = sr_fib_image_align(hdr.tbl24_off +
+                            (uint64_t)SR_DIR24_TBL24_SZ * sizeof(uint32_t));
+        hdr.size      = hdr.tbl8_off +
+                        (uint64_t)fib->ntbl8 * SR_DIR24_TBL8_SZ * sizeof(uint32_t);
+    }
+    else
+    {
+        hdr.nnodes    = fib->nnodes;
+        hdr.nodes_off = sr_fib_image_align(hdr.size);
+        hdr.size      = hdr.nodes_off +
+                        (uint64_t)fib->nnodes * sizeof(struct sr_fib_node);
+    }
+
+    if((tmp = (char*)malloc(strlen(filename) + 5)) == 0)
+    { return -1; }
+    sprintf(tmp, "%s.tmp", filename);
+
+    if((fp = fopen(tmp, "w")) == 0)
+    {
+        perror("fopen");
+        free(tmp);
+        return -1;
+    }
+
+    if(fwrite(&hdr, sizeof(struct sr_fib_image), 1, fp) != 1)
+    { ret = -1; }
+    if(ret == 0)
+    {
+        ret = sr_fib_image_write(fp, hdr.routes_off, fib->routes,
+                    (size_t)fib->nroutes * sizeof(struct sr_fib_route));
+    }
+    if(ret == 0)
+    {
+        ret = sr_fib_image_write(fp, hdr.nhs_off, fib->nhs,
+                    (size_t)fib->nnhs * sizeof(struct sr_fib_nh));
+    }
+    if(ret == 0 && fib->engine == SR_FIB_DIR24)
+    {
+        ret = sr_fib_image_write(fp, hdr.tbl24_off, fib->tbl24,
+                    (size_t)SR_DIR24_TBL24_SZ * sizeof(uint32_t));
+        if(ret == 0)
+        {
+            ret = sr_fib_image_write(fp, hdr.tbl8_off, fib->tbl8,
+                    (size_t)fib->ntbl8 * SR_DIR24_TBL8_SZ * sizeof(uint32_t));
+        }
+    }
+    if(ret == 0 && fib->engine != SR_FIB_DIR24)
+    {
+        ret = sr_fib_image_write(fp, hdr.nodes_off, fib->nodes,
+                    (size_t)fib->nnodes * sizeof(struct sr_fib_node));
+    }
+    if(ret == 0 && (fflush(fp) != 0 ||
+                    ftruncate(fileno(fp), (off_t)hdr.size) != 0))
+    { ret = -1; }
+    if(fclose(fp) != 0)
+    { ret = -1; }
+
+    if(ret == 0 && rename(tmp, filename) != 0)
+    { ret = -1; }
+    if(ret != 0)
+    {
+        perror("Error writing forwarding table image");
+        unlink(tmp);
+    }
+
+    free(tmp);
+    return ret;
+} /* -- sr_fib_save -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_is_image(..)
+ * Scope: Global
+ *
+ * True if the open file starts with an image header.  The file is
+ * rewound either way.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_is_image(FILE* fp)
+{
+    char magic[8];
+    int ret;
+
+    assert(fp);
+
+    ret = fread(magic, sizeof(magic), 1, fp) == 1 &&
+          memcmp(magic, SR_FIB_IMAGE_MAGIC, sizeof(magic)) == 0;
+    rewind(fp);
+
+    return ret;
+} /* -- sr_fib_is_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_check(..)
+ * Scope: Local
+ *
+ * Make sure an image header describes arrays that fit the file.  The
+ * contents of the arrays are trusted, checking them would mean reading
+ * every page of the image.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_fib_image_check(const struct sr_fib_image* hdr, uint64_t size)
+{
+    uint64_t end;
+
+    if(memcmp(hdr->magic, SR_FIB_IMAGE_MAGIC, sizeof(hdr->magic)) != 0 ||
+       hdr->version != SR_FIB_IMAGE_VERSION ||
+       hdr->byte_order != SR_FIB_IMAGE_ORDER ||
+       hdr->rt_size != sizeof(struct sr_fib_route) ||
+       hdr->nh_size != sizeof(struct sr_fib_nh) ||
+       hdr->size != size || hdr->nnhs > SR_FIB_MAX_NHS)
+    { return -1; }
+
+    end = hdr->routes_off +
+          (uint64_t)hdr->nroutes * sizeof(struct sr_fib_route);
+    if(hdr->routes_off % SR_FIB_IMAGE_ALIGN || end > size)
+    { return -1; }
+    end = hdr->nhs_off + (uint64_t)hdr->nnhs * sizeof(struct sr_fib_nh);
+    if(hdr->nhs_off % SR_FIB_IMAGE_ALIGN || end > size)
+    { return -1; }
+
+    if(hdr->engine == SR_FIB_DIR24)
+    {
+        end = hdr->tbl24_off + (uint64_t)SR_DIR24_TBL24_SZ * sizeof(uint32_t);
+        if(hdr->tbl24_off % SR_FIB_IMAGE_ALIGN || end > size)
+        { return -1; }
+        end = hdr->tbl8_off +
+              (uint64_t)hdr->ntbl8 * SR_DIR24_TBL8_SZ * sizeof(uint32_t);
+        if(hdr->tbl8_off % SR_FIB_IMAGE_ALIGN || end > size)
+        { return -1; }
+        return 0;
+    }
+
+    if(hdr->engine != SR_FIB_TRIE || hdr->nnodes == 0)
+    { return -1; }
+    end = hdr->nodes_off + (uint64_t)hdr->nnodes * sizeof(struct sr_fib_node);
+    if(hdr->nodes_off % SR_FIB_IMAGE_ALIGN || end > size)
+    { return -1; }
+
+    return 0;
+} /* -- sr_fib_image_check -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_map(..)
+ * Scope: Global
+ *
+ * Map an image written by sr_fib_save as a ready to use, read only
+ * table.  Nothing is read up front; pages are faulted in from the page
+ * cache as lookups touch them.  Returns 0 if the file is not a valid
+ * image for this machine.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_map(const char* filename)
+{
+    const struct sr_fib_image* hdr = 0;
+    struct sr_fib* fib = 0;
+    struct stat st;
+    char* map = 0;
+    int fd;
+
+    /* -- REQUIRES -- */
+    assert(filename);
+
+    if((fd = open(filename, O_RDONLY)) < 0)
+    {
+        perror("open");
+        return 0;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct sr_fib_image))
+    {
+        fprintf(stderr,"%s: not a forwarding table image\n", filename);
+        close(fd);
+        return 0;
+    }
+
+    map = (char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+
+    hdr = (const struct sr_fib_image*)map;
+    if(sr_fib_image_check(hdr, st.st_size) != 0)
+    {
+        fprintf(stderr,"%s: bad or incompatible forwarding table image\n",
+                filename);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    if((fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib))) == 0)
+    {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    fib->engine     = hdr->engine;
+    fib->routes     = (struct sr_fib_route*)(map + hdr->routes_off);
+    fib->nroutes    = fib->routes_cap = hdr->nroutes;
+    fib->nhs        = (struct sr_fib_nh*)(map + hdr->nhs_off);
+    fib->nnhs       = fib->nhs_cap = hdr->nnhs;
+    if(fib->engine == SR_FIB_DIR24)
+    {
+        fib->tbl24 = (uint32_t*)(map + hdr->tbl24_off);
+        fib->tbl8  = (uint32_t*)(map + hdr->tbl8_off);
+        fib->ntbl8 = fib->tbl8_cap = hdr->ntbl8;
+    }
+    else
+    {
+        fib->nodes  = (struct sr_fib_node*)(map + hdr->nodes_off);
+        fib->nnodes = fib->nodes_cap = hdr->nnodes;
+    }
+    fib->map     = map;
+    fib->map_len = st.st_size;
+
+    return fib;
+} /* -- sr_fib_map -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_engine_parse(..)
+ * Scope: Global
+ *
+ * Map an engine name as given on the command line to its id, -1 if the
+ * name is unknown.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_engine_parse(const char* name)
+{
+    assert(name);
+
+    if(strcmp(name, "trie") == 0)
+    { return SR_FIB_TRIE; }
+    if(strcmp(name, "dir24") == 0)
+    { return SR_FIB_DIR24; }
+
+    return -1;
+} /* -- sr_fib_engine_parse -- */
+
+const char* sr_fib_engine_name(int engine)
+{
+    return engine == SR_FIB_DIR24 ? "dir24" : "trie";
+} /* -- sr_fib_engine_name -- */
@@ -0,0 +1,204 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * Forwarding information base built from the routing table.  Two lookup
+ * engines are available, picked when the table is created:
+ *
+ * SR_FIB_TRIE  - a multibit trie (fixed stride of SR_FIB_STRIDE bits, with
+ *                controlled prefix expansion inside each node).  A longest
+ *                prefix match costs at most one node visit per
+ *                SR_FIB_STRIDE bits of prefix, regardless of how many
+ *                routes are loaded.  Nodes live in a single array and refer
+ *                to each other by index, the root being node 0.
+ *
+ * SR_FIB_DIR24 - DIR-24-8: a directly indexed 2^24 entry table for the
+ *                first 24 bits of the address, plus 256 entry second level
+ *                groups for the /24s that hold longer prefixes.  Every
+ *                lookup is one or two memory accesses, at the price of a
+ *                fixed 64MB first level.
+ *
+ * Routes don't name their interface and gateway themselves: each distinct
+ * (gateway, interface) pair is stored once as a next hop, the routes and
+ * the lookup structure refer to it by index, and a lookup yields the next
+ * hop directly.  A full table has a handful of next hops for millions of
+ * prefixes, which is what lets the router resolve and cache one Ethernet
+ * header per next hop (see struct sr_adj in sr_rt.h).
+ *
+ * A built table can be saved as a binary image (sr_fib_save, see the
+ * rtcompile tool) and later mapped read only straight from the file
+ * (sr_fib_map).  Mapping costs no parsing or building, and the pages come
+ * from the page cache, so every router mapping the same image shares them.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_FIB_H
+#define sr_FIB_H
+
+#ifdef _DARWIN_
+#include <sys/types.h>
+#endif
+
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "sr_rt.h"
+
+#define SR_FIB_TRIE  0
+#define SR_FIB_DIR24 1
+
+#define SR_FIB_STRIDE 4
+#define SR_FIB_FANOUT (1 << SR_FIB_STRIDE)
+
+/* Lookups resolved together by sr_fib_find_bulk */
+#define SR_FIB_BULK 8
+
+#define SR_DIR24_TBL24_SZ (1u << 24)
+#define SR_DIR24_TBL8_SZ  256
+
+/* A leaf word holds the prefix length in bits 25-30 and the index of the
+ * route's next hop plus one in the low bits, 0 meaning no route.  In the
+ * DIR-24-8 first level, SR_FIB_LEAF_EXT marks an entry whose low bits are
+ * instead the index of a second level group. */
+#define SR_FIB_LEAF_BITS        25
+#define SR_FIB_LEAF_MASK        ((1u << SR_FIB_LEAF_BITS) - 1)
+#define SR_FIB_LEAF_EXT         0x80000000u
+#define SR_FIB_LEAF(depth,idx)  (((uint32_t)(depth) << SR_FIB_LEAF_BITS) | \
+                                 ((uint32_t)(idx) + 1))
+#define SR_FIB_LEAF_DEPTH(leaf) (((leaf) >> SR_FIB_LEAF_BITS) & 0x3f)
+#define SR_FIB_LEAF_INDEX(leaf) (((leaf) & SR_FIB_LEAF_MASK) - 1)
+#define SR_FIB_MAX_NHS          SR_FIB_LEAF_MASK
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_nh
+ *
+ * A next hop shared by every route through the same gateway and interface.
+ * A gateway of 0.0.0.0 means the destination is directly connected.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_nh
+{
+    struct in_addr gw;
+    char           interface[sr_IFACE_NAMELEN];
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_route
+ *
+ * A route as kept in the table, for listing and copying it (lookups go
+ * through the leaves and never read these)
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_route
+{
+    struct in_addr dest;
+    struct in_addr mask;
+    uint32_t       nh;   /* index in nhs[] */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_image
+ *
+ * Header of a binary image.  The arrays of struct sr_fib follow at the
+ * given offsets, each page aligned, in host byte order; an image only
+ * loads on the kind of machine that wrote it.
+ *
+ * -------------------------------------------------------------------------- */
+
+#define SR_FIB_IMAGE_MAGIC   "SRFIBIMG"
+#define SR_FIB_IMAGE_VERSION 2
+#define SR_FIB_IMAGE_ORDER   0x01020304
+#define SR_FIB_IMAGE_ALIGN   4096
+
+struct sr_fib_image
+{
+    char     magic[8];     /* SR_FIB_IMAGE_MAGIC, not NUL terminated */
+    uint32_t version;      /* SR_FIB_IMAGE_VERSION */
+    uint32_t byte_order;   /* SR_FIB_IMAGE_ORDER as written */
+    uint32_t rt_size;      /* sizeof(struct sr_fib_route) */
+    uint32_t nh_size;      /* sizeof(struct sr_fib_nh) */
+    uint32_t engine;
+    uint32_t nroutes;
+    uint32_t nnhs;
+    uint32_t nnodes;
+    uint32_t ntbl8;
+    uint32_t pad;
+    uint64_t routes_off;
+    uint64_t nhs_off;
+    uint64_t nodes_off;
+    uint64_t tbl24_off;
+    uint64_t tbl8_off;
+    uint64_t size;         /* total file size */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_node
+ *
+ * One level of the trie, covering SR_FIB_STRIDE bits of the address
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_node
+{
+    uint32_t child[SR_FIB_FANOUT]; /* index of the next level, 0 if none */
+    uint32_t leaf[SR_FIB_FANOUT];  /* best route ending in this slot */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib
+ *
+ * The compiled table.  Lookups return pointers into nhs[]; routes[] keeps
+ * every inserted route in order.  If map is set the arrays point into a
+ * read only image and nothing may be inserted.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib
+{
+    int                  engine;     /* SR_FIB_TRIE or SR_FIB_DIR24 */
+    struct sr_fib_route* routes;
+    uint32_t             nroutes;
+    uint32_t             routes_cap;
+    struct sr_fib_nh*    nhs;
+    uint32_t             nnhs;
+    uint32_t             nhs_cap;
+    uint32_t*            nh_hash;    /* nhs index + 1 by (gw, interface) */
+    uint32_t             nh_hash_sz; /* power of two, 0 for a mapped image */
+
+    /* -- SR_FIB_TRIE -- */
+    struct sr_fib_node*  nodes;
+    uint32_t             nnodes;
+    uint32_t             nodes_cap;
+
+    /* -- SR_FIB_DIR24 -- */
+    uint32_t*            tbl24;
+    uint32_t*            tbl8;       /* ntbl8 groups of SR_DIR24_TBL8_SZ */
+    uint32_t             ntbl8;
+    uint32_t             tbl8_cap;
+
+    long                 build_usec; /* time taken to load, set by sr_rt.c */
+
+    void*                map;        /* mapped image, 0 if built in memory */
+    size_t               map_len;
+};
+
+struct sr_fib* sr_fib_create(int engine);
+void sr_fib_destroy(struct sr_fib*);
+int sr_fib_insert(struct sr_fib*, const struct sr_rt*);
+struct sr_fib_nh* sr_fib_find(const struct sr_fib*, uint32_t ip_nbo);
+void sr_fib_find_bulk(const struct sr_fib*, const uint32_t* ip_nbo, int n,
+                      struct sr_fib_nh** out);
+void sr_fib_route_get(const struct sr_fib*, uint32_t i, struct sr_rt* out);
+int sr_fib_mask_len(uint32_t mask_nbo);
+size_t sr_fib_memory(const struct sr_fib*);
+void sr_fib_report(const struct sr_fib*);
+int sr_fib_save(const struct sr_fib*, const char* filename);
+int sr_fib_is_image(FILE*);
+struct sr_fib* sr_fib_map(const char* filename);
+int sr_fib_engine_parse(const char*);
+const char* sr_fib_engine_name(int engine);
+
+#endif  /* --  sr_FIB_H -- */
@@ -0,0 +1,70 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flowcache.c
+ *
+ * Description:
+ *
+ * Exact match cache of forwarding decisions (see sr_flowcache.h)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include "sr_flowcache.h"
+#include "sr_if.h"
+
+/* Fibonacci hash of the address onto a slot; the cache is direct mapped. */
+static unsigned int sr_flowcache_slot(uint32_t ip) {
+    return (ip * 2654435761u) >> (32 - SR_FLOWCACHE_BITS);
+}
+
+void sr_flowcache_init(struct sr_flowcache *cache) {
+    memset(cache, 0, sizeof(struct sr_flowcache));
+}
+
+struct sr_flowentry *sr_flowcache_lookup(struct sr_flowcache *cache,
+                                         uint32_t ip,
+                                         uint32_t rt_gen,
+                                         uint32_t arp_gen)
+{
+    struct sr_flowentry *entry = &(cache->entries[sr_flowcache_slot(ip)]);
+
+    if (entry->valid && entry->ip == ip &&
+        entry->rt_gen == rt_gen && entry->arp_gen == arp_gen) {
+        cache->hits++;
+        return entry;
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+void sr_flowcache_insert(struct sr_flowcache *cache,
+                         uint32_t ip,
+                         uint32_t rt_gen,
+                         uint32_t arp_gen,
+                         struct sr_if *iface,
+                         uint32_t next_hop,
+                         uint32_t arp_round,
+                         const unsigned char *mac)
+{
+    struct sr_flowentry *entry = &(cache->entries[sr_flowcache_slot(ip)]);
+
+    entry->ip = ip;
+    entry->rt_gen = rt_gen;
+    entry->arp_gen = arp_gen;
+    entry->ifid = iface->id;
+    entry->next_hop = next_hop;
+    entry->arp_round = arp_round;
+    memcpy(entry->eth.ether_dhost, mac, ETHER_ADDR_LEN);
+    memcpy(entry->eth.ether_shost, iface->addr, ETHER_ADDR_LEN);
+    entry->eth.ether_type = htons(ethertype_ip);
+    entry->valid = 1;
+}
+
+void sr_flowcache_dump(struct sr_flowcache *cache) {
+    unsigned long total = cache->hits + cache->misses;
+
+    fprintf(stderr, "Flow cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+            cache->hits, cache->misses,
+            total ? 100.0 * cache->hits / total : 0.0);
+}
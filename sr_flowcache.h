@@ -0,0 +1,75 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_flowcache.h
+ *
+ * Description:
+ *
+ * Exact match cache of forwarding decisions, keyed on destination IP.  An
+ * entry holds everything needed to send a packet on without consulting the
+ * FIB, the interface list or the ARP cache: the egress interface and a
+ * ready-made Ethernet header (next-hop MAC, our MAC, ethertype IP).
+ *
+ * The forwarding decision only depends on the destination, so that is the
+ * whole key.  Entries are never explicitly flushed; each remembers the
+ * routing table and ARP cache generations it was built under and stops
+ * matching as soon as either has moved on (a route was added or the table
+ * reloaded, an ARP mapping was learnt or expired).
+ *
+ * Only the forwarding thread touches the cache, so it has no lock.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FLOWCACHE_H
+#define SR_FLOWCACHE_H
+
+#include <inttypes.h>
+#include "sr_protocol.h"
+
+#define SR_FLOWCACHE_BITS 12
+#define SR_FLOWCACHE_SZ   (1 << SR_FLOWCACHE_BITS)
+
+struct sr_if;
+
+struct sr_flowentry {
+    uint32_t ip;                /* Destination, network byte order */
+    uint32_t rt_gen;            /* Routing table generation when built */
+    uint32_t arp_gen;           /* ARP cache generation when built */
+    int valid;
+    uint32_t next_hop;          /* Whose MAC eth holds */
+    uint32_t arp_round;         /* ARP round next_hop was last looked up in,
+                                   see sr_arpcache_round */
+    int ifid;                   /* Egress interface's number */
+    sr_ethernet_hdr_t eth;      /* Header to copy over the packet's */
+};
+
+struct sr_flowcache {
+    struct sr_flowentry entries[SR_FLOWCACHE_SZ];
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/* Invalidates every entry and clears the counters. */
+void sr_flowcache_init(struct sr_flowcache *cache);
+
+/* Returns the entry for ip if there is one built under the given
+   generations, NULL otherwise. Counts a hit or a miss. */
+struct sr_flowentry *sr_flowcache_lookup(struct sr_flowcache *cache,
+                                         uint32_t ip,
+                                         uint32_t rt_gen,
+                                         uint32_t arp_gen);
+
+/* Remembers that packets to ip leave on iface towards mac, the MAC of
+   next_hop as of ARP round arp_round. The generations must be the ones
+   read before the route and ARP lookups were made. */
+void sr_flowcache_insert(struct sr_flowcache *cache,
+                         uint32_t ip,
+                         uint32_t rt_gen,
+                         uint32_t arp_gen,
+                         struct sr_if *iface,
+                         uint32_t next_hop,
+                         uint32_t arp_round,
+                         const unsigned char *mac);
+
+/* Prints the hit/miss counters. */
+void sr_flowcache_dump(struct sr_flowcache *cache);
+
+#endif
@@ -54,11 +54,44 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
     return 0;
 } /* -- sr_get_interface -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_get_interface_id
+ * Scope: Global
+ *
+ * Given an interface number return the interface record or 0 if it
+ * doesn't exist.  For the forwarding path, no names are compared.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface_id(struct sr_instance* sr, int id)
+{
+    if(id < 0 || id >= sr->nifs)
+    { return 0; }
+
+    return sr->if_table[id];
+} /* -- sr_get_interface_id -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_interface_id
+ * Scope: Global
+ *
+ * Given an interface name return its number or SR_IF_NONE if it doesn't
+ * exist.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_interface_id(struct sr_instance* sr, const char* name)
+{
+    struct sr_if* iface = sr_get_interface(sr, name);
+
+    return iface ? iface->id : SR_IF_NONE;
+} /* -- sr_interface_id -- */
+
 /*---------------------------------------------------------------------
  * Method: sr_add_interface(..)
  * Scope: Global
  *
- * Add and interface to the router's list
+ * Add and interface to the router's list, numbered next in if_table
  *
  *---------------------------------------------------------------------*/
 
@@ -70,6 +103,12 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     assert(name);
     assert(sr);
 
+    if(sr->nifs >= SR_IF_MAX)
+    {
+        fprintf(stderr,"Too many interfaces, ignoring %s\n", name);
+        return;
+    }
+
     /* -- empty list special case -- */
     if(sr->if_list == 0)
     {
@@ -77,6 +116,10 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         assert(sr->if_list);
         sr->if_list->next = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        sr->if_list->id = sr->nifs;
+        sr->if_list->arp_tokens = 0;
+        sr->if_list->arp_refill = 0;
+        sr->if_table[sr->nifs++] = sr->if_list;
         return;
     }
 
@@ -89,7 +132,11 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     assert(if_walker->next);
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
+    if_walker->id = sr->nifs;
+    if_walker->arp_tokens = 0;
+    if_walker->arp_refill = 0;
     if_walker->next = 0;
+    sr->if_table[sr->nifs++] = if_walker;
 } /* -- sr_add_interface -- */
 
 /*---------------------------------------------------------------------
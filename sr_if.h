@@ -26,6 +26,13 @@
 
 #include "sr_protocol.h"
 
+/* Interfaces are numbered 0 .. SR_IF_MAX-1 in the order the server
+ * announces them.  The forwarding path, routes, and queued packets refer
+ * to them by number; names are only looked up where they come in from
+ * outside (the server, the routing table file, a snapshot). */
+#define SR_IF_MAX  16
+#define SR_IF_NONE (-1) /* no such interface */
+
 struct sr_instance;
 
 /* ----------------------------------------------------------------------------
@@ -38,13 +45,18 @@ struct sr_instance;
 struct sr_if
 {
   char name[sr_IFACE_NAMELEN];
+  int id;               /* index in sr->if_table */
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  uint32_t arp_tokens;  /* ARP requests allowed out, in 1/1000ths */
+  uint64_t arp_refill;  /* ms when arp_tokens was last topped up */
   struct sr_if* next;
 };
 
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
+struct sr_if* sr_get_interface_id(struct sr_instance* sr, int id);
+int sr_interface_id(struct sr_instance* sr, const char* name);
 void sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
@@ -22,6 +22,7 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <sys/types.h>
 
@@ -32,6 +33,9 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_snapshot.h"
+#include "sr_arena.h"
 
 extern char* optarg;
 
@@ -64,12 +68,26 @@ int main(int argc, char **argv)
     char *template = NULL;
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
+    int fib_engine = SR_FIB_TRIE;
+    long arp_max = SR_ARPCACHE_MAX;
+    long arpq_max = SR_ARPREQ_QLEN;
+    int arpq_policy = SR_ARPQ_DROP_NEWEST;
+    long arpq_budget = SR_ARPREQ_BUDGET;
+    char *policy;
+    int arp_garp = 0;
+    char *snapshot = 0;
+    long tx_frames = SR_TXQ_MAX;
+    long tx_bytes = SR_TXQ_BYTES;
+    long egress_max = SR_EGRESS_QLEN;
+    int egress_policy = SR_EGRESS_DROP_NEWEST;
+    int arena_mode = SR_ARENA_AUTO;
+    long ip_verify = 1;
     char *logfile = 0;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:F:A:Q:B:GS:W:E:H:C:")) != EOF)
     {
         switch (c)
         {
@@ -101,11 +119,125 @@ int main(int argc, char **argv)
             case 'T':
                 template = optarg;
                 break;
+            case 'F':
+                if((fib_engine = sr_fib_engine_parse(optarg)) < 0)
+                {
+                    fprintf(stderr,"Unknown forwarding engine %s\n",optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'A':
+                if((arp_max = atol(optarg)) <= 0)
+                {
+                    fprintf(stderr,"Bad ARP cache size %s\n",optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'Q':
+                /* -- packets[,newest|oldest] -- */
+                if((policy = strchr(optarg, ',')) != 0)
+                { *policy++ = 0; }
+                arpq_max = atol(optarg);
+                if(policy && strcmp(policy, "oldest") == 0)
+                { arpq_policy = SR_ARPQ_DROP_OLDEST; }
+                else if(policy && strcmp(policy, "newest") != 0)
+                { arpq_max = 0; }
+                if(arpq_max <= 0)
+                {
+                    fprintf(stderr,"Bad ARP queue limit %s\n",optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'G':
+                arp_garp = 1;
+                break;
+            case 'S':
+                snapshot = optarg;
+                break;
+            case 'B':
+                if((arpq_budget = atol(optarg)) <= 0)
+                {
+                    fprintf(stderr,"Bad ARP queue budget %s\n",optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'W':
+                /* -- packets[,bytes] -- */
+                if((policy = strchr(optarg, ',')) != 0)
+                {
+                    *policy++ = 0;
+                    tx_bytes = atol(policy);
+                }
+                tx_frames = atol(optarg);
+                if(tx_frames <= 0 || tx_frames > SR_TXQ_MAX || tx_bytes <= 0)
+                {
+                    fprintf(stderr,"Bad transmit batch %s\n",optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'E':
+                /* -- packets[,newest|oldest] -- */
+                if((policy = strchr(optarg, ',')) != 0)
+                { *policy++ = 0; }
+                egress_max = atol(optarg);
+                if(policy && strcmp(policy, "oldest") == 0)
+                { egress_policy = SR_EGRESS_DROP_OLDEST; }
+                else if(policy && strcmp(policy, "newest") != 0)
+                { egress_max = 0; }
+                if(egress_max <= 0)
+                {
+                    fprintf(stderr,"Bad egress queue limit %s\n",optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'H':
+                if((arena_mode = sr_arena_parse_mode(optarg)) < 0)
+                {
+                    fprintf(stderr,"Bad hugepage mode %s\n",optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                /* -- all, off or 1 in N -- */
+                if(strcmp(optarg, "all") == 0)
+                { ip_verify = 1; }
+                else if(strcmp(optarg, "off") == 0)
+                { ip_verify = 0; }
+                else if((ip_verify = atol(optarg)) <= 0)
+                {
+                    fprintf(stderr,"Bad checksum verification %s\n",optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
         } /* switch */
     } /* -- while -- */
 
+    /* -- before anything big is allocated -- */
+    sr_arena_mode(arena_mode);
+
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.fib_engine = fib_engine;
+    sr.arp_max = arp_max;
+    sr.arpq_max = arpq_max;
+    sr.arpq_policy = arpq_policy;
+    sr.arpq_budget = arpq_budget;
+    sr.arp_garp = arp_garp;
+    sr.txq.max_frames = tx_frames;
+    sr.txq.max_bytes = tx_bytes;
+    sr.egress.max = egress_max;
+    sr.egress.policy = egress_policy;
+    sr.ip_verify = ip_verify;
+    if(snapshot)
+    { strncpy(sr.snapshot, snapshot, sizeof(sr.snapshot) - 1); }
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -162,6 +294,9 @@ int main(int argc, char **argv)
     /* -- whizbang main loop ;-) */
     while( sr_read_from_server(&sr) == 1);
 
+    if(sr.snapshot[0])
+    { sr_snapshot_save(&sr); }
+
     sr_destroy_instance(&sr);
 
     return 0;
@@ -178,9 +313,26 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-l log file] [-F trie|dir24] \n");
+    printf("           [-A max ARP cache entries] \n");
+    printf("           [-Q packets queued per ARP request[,newest|oldest]] \n");
+    printf("           [-B bytes queued over all ARP requests] \n");
+    printf("           [-G learn from gratuitous ARP] \n");
+    printf("           [-S warm start snapshot file] \n");
+    printf("           [-W packets[,bytes] sent to the server at once] \n");
+    printf("           [-E packets queued per interface[,newest|oldest]] \n");
+    printf("           [-H auto|thp|off hugepages for tables and buffers] \n");
+    printf("           [-C all|off|N check IP checksums, of 1 packet in N] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
+    printf("   ARP cache entries=%d\n", SR_ARPCACHE_MAX);
+    printf("   ARP queue=%d,newest budget=%d\n", SR_ARPREQ_QLEN,
+            SR_ARPREQ_BUDGET);
+    printf("   transmit batch=%d,%d (1 sends each packet on its own)\n",
+            SR_TXQ_MAX, SR_TXQ_BYTES);
+    printf("   egress queue=%d,newest\n", SR_EGRESS_QLEN);
+    printf("   hugepages=auto (hugetlb, else transparent hugepages)\n");
+    printf("   IP checksums=all\n");
 } /* -- usage -- */
 
 /*-----------------------------------------------------------------------------
@@ -225,6 +377,17 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    sr_flowcache_dump(&(sr->flows));
+    printf("IP checksums: %lu of %lu packets checked, %lu bad\n",
+           sr->ip_checked, sr->ip_seen, sr->ip_bad);
+    printf("VNS reader: %lu packets in %lu reads\n", sr->rx_frames,
+           sr->rx_reads);
+    printf("VNS writer: %lu packets in %lu writes\n", sr->txq.frames,
+           sr->txq.writes);
+    sr_egress_dump(&(sr->egress), sr->if_table, sr->nifs);
+    sr_mbuf_pool_dump(&(sr->rx_pool));
+    sr_mbuf_pool_dump(sr_mbuf_frames());
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -243,11 +406,54 @@ static void sr_init_instance(struct sr_instance* sr)
     assert(sr);
 
     sr->sockfd = -1;
+    sr_mbuf_pool_init(&(sr->rx_pool), "receive", SR_RX_BUF, SR_RX_POOL);
+    sr_mbuf_frames(); /* -- now, not on the first packet -- */
+    sr->rx_mbuf = 0;
+    sr->rx_buf = 0;
+    sr->rx_start = 0;
+    sr->rx_end = 0;
+    sr->rx_reads = 0;
+    sr->rx_frames = 0;
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
-    sr->routing_table = 0;
+    sr->nifs = 0;
+    sr->rt = 0;
+    pthread_mutex_init(&(sr->rt_lock), 0);
+    sr_epoch_init(&(sr->epoch));
+    sr->fib_engine = SR_FIB_TRIE;
+    sr->arp_max = SR_ARPCACHE_MAX;
+    sr->arpq_max = SR_ARPREQ_QLEN;
+    sr->arpq_policy = SR_ARPQ_DROP_NEWEST;
+    sr->arpq_budget = SR_ARPREQ_BUDGET;
+    sr->arp_garp = 0;
+    sr->ip_verify = 1;
+    sr->ip_seen = 0;
+    sr->ip_checked = 0;
+    sr->ip_bad = 0;
+    sr->rt_gen = 0;
+    sr->rtable[0] = 0;
+    sr->rt_file_gen = 0;
+    sr->rt_size = 0;
+    memset(sr->rt_digest, 0, sizeof(sr->rt_digest));
+    sr->snapshot[0] = 0;
+    sr->snap_gen = 0;
+    pthread_mutex_init(&(sr->send_lock), 0);
+    sr->txq.n = 0;
+    sr->txq.bytes = 0;
+    sr->txq.max_frames = SR_TXQ_MAX;
+    sr->txq.max_bytes = SR_TXQ_BYTES;
+    sr->txq.writes = 0;
+    sr->txq.frames = 0;
+    sr_egress_init(&(sr->egress), SR_EGRESS_QLEN, SR_EGRESS_DROP_NEWEST);
+    if(pipe(sr->tx_wake) == 0)
+    {
+        fcntl(sr->tx_wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(sr->tx_wake[1], F_SETFL, O_NONBLOCK);
+    }
+    else
+    { sr->tx_wake[0] = sr->tx_wake[1] = -1; }
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -268,42 +474,48 @@ static void sr_init_instance(struct sr_instance* sr)
 
 int sr_verify_routing_table(struct sr_instance* sr)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_rt_table* table = 0;
+    struct sr_fib_nh* nh = 0;
     struct sr_if* if_walker = 0;
+    uint32_t i;
     int ret = 0;
 
     /* -- REQUIRES --*/
     assert(sr);
 
-    if( (sr->if_list == 0) || (sr->routing_table == 0))
+    sr_epoch_enter(&(sr->epoch));
+    table = sr_rt_current(sr);
+
+    if( (sr->if_list == 0) || (table == 0) || (table->fib->nroutes == 0))
     {
+        sr_epoch_exit(&(sr->epoch));
         return 999; /* doh! */
     }
 
-    rt_walker = sr->routing_table;
-
-    while(rt_walker)
+    /* -- routes share their interfaces through the next hops -- */
+    for(i = 0; i < table->fib->nnhs; i++)
     {
+        nh = &table->fib->nhs[i];
+
         /* -- check to see if interface exists -- */
         if_walker = sr->if_list;
         while(if_walker)
         {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
+            if( strncmp(if_walker->name,nh->interface,sr_IFACE_NAMELEN)
                     == 0)
             { break; }
             if_walker = if_walker->next;
         }
         if(if_walker == 0)
         { ret++; } /* -- interface not found! -- */
+    } /* -- for -- */
 
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
-
+    sr_epoch_exit(&(sr->epoch));
     return ret;
 } /* -- sr_verify_routing_table -- */
 
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
-    if(sr_load_rt(sr, rtable) != 0) {
+    if(sr_snapshot_load_rt(sr, rtable) != 0 && sr_load_rt(sr, rtable) != 0) {
         fprintf(stderr,"Error setting up routing table from file %s\n",
                 rtable);
         exit(1);
@@ -314,4 +526,5 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
     printf("---------------------------------------------\n");
     sr_print_routing_table(sr);
     printf("---------------------------------------------\n");
+    sr_fib_report(sr->rt->fib);
 }
@@ -0,0 +1,367 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_mbuf.c
+ *
+ * Description:
+ *
+ * Reference counted buffer pools (see sr_mbuf.h)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "sr_mbuf.h"
+#include "sr_arena.h"
+
+/* ----------------------------------------------------------------------------
+ * struct sr_mbuf_cache
+ *
+ * A thread's free list for one pool
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_mbuf_cache
+{
+    struct sr_mbuf* head;
+    uint32_t n;
+    int gets;             /* the thread takes buffers from the pool too */
+};
+
+/* -- each thread has a free list per pool, pools are numbered -- */
+static __thread struct sr_mbuf_cache sr_mbuf_caches[SR_MBUF_POOLS];
+static int sr_mbuf_npools = 0;
+
+static struct sr_mbuf_pool sr_mbuf_frame_pool;
+static pthread_once_t sr_mbuf_frame_once = PTHREAD_ONCE_INIT;
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_grow(..)
+ * Scope: Local
+ *
+ * Carves the buffers of another slab onto the shared free list.  Caller
+ * holds the pool's lock.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_mbuf_grow(struct sr_mbuf_pool* pool)
+{
+    uint8_t* slab;
+    struct sr_mbuf* m;
+    size_t len = pool->slab;
+    uint32_t i, n;
+
+    slab = (uint8_t*)sr_arena_alloc(&len, "buffer pool", pool->name);
+    if(slab == 0)
+    {
+        fprintf(stderr, "Error: out of memory (buffer pool %s)\n",
+                pool->name);
+        return -1;
+    }
+
+    /* -- all that fits, the arena may have rounded up -- */
+    n = len / pool->stride;
+    for(i = 0; i < n; i++)
+    {
+        m = (struct sr_mbuf*)(slab + i * pool->stride);
+        m->pool = pool;
+        m->refcnt = 0;
+        m->size = pool->size;
+        m->data = (uint8_t*)m + SR_MBUF_HDR;
+        m->next = pool->free;
+        pool->free = m;
+    }
+    pool->nfree += n;
+    pool->nbufs += n;
+    pool->nslabs++;
+    return 0;
+} /* -- sr_mbuf_grow -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_pool_init(..)
+ * Scope: Global
+ *
+ * Sets up a pool of buffers with size bytes of data each and carves out
+ * at least count of them.  Returns 0, or -1 if there are SR_MBUF_POOLS
+ * pools already or no memory.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_mbuf_pool_init(struct sr_mbuf_pool* pool, const char* name,
+                      size_t size, uint32_t count)
+{
+    int ret = 0;
+
+    assert(pool);
+    assert(sizeof(struct sr_mbuf) <= SR_MBUF_HDR);
+
+    memset(pool, 0, sizeof(struct sr_mbuf_pool));
+    pool->name = name;
+    pool->size = size;
+    pool->stride = SR_MBUF_HDR +
+        (size + SR_MBUF_ALIGN - 1) / SR_MBUF_ALIGN * SR_MBUF_ALIGN;
+    pool->slab = (size_t)count * pool->stride;
+    if(pool->slab < SR_MBUF_SLAB)
+    { pool->slab = SR_MBUF_SLAB / pool->stride * pool->stride; }
+    if(pool->slab == 0)
+    { pool->slab = pool->stride; }
+    pthread_mutex_init(&(pool->lock), 0);
+
+    pool->id = __atomic_fetch_add(&sr_mbuf_npools, 1, __ATOMIC_SEQ_CST);
+    if(pool->id >= SR_MBUF_POOLS)
+    {
+        fprintf(stderr, "Error: more than %d buffer pools\n", SR_MBUF_POOLS);
+        return -1;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    while(ret == 0 && pool->nbufs < count)
+    { ret = sr_mbuf_grow(pool); }
+    pthread_mutex_unlock(&(pool->lock));
+
+    return ret;
+} /* -- sr_mbuf_pool_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_pool_dump(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_mbuf_pool_dump(struct sr_mbuf_pool* pool)
+{
+    assert(pool);
+
+    pthread_mutex_lock(&(pool->lock));
+    fprintf(stderr, "Buffer pool %s: %u buffers of %lu bytes in %u slabs, "
+            "%u free in the pool\n", pool->name, pool->nbufs,
+            (unsigned long)pool->size, pool->nslabs, pool->nfree);
+    if(pool->oversize)
+    {
+        fprintf(stderr, "Buffer pool %s: %lu frames too long to keep\n",
+                pool->name, pool->oversize);
+    }
+    pthread_mutex_unlock(&(pool->lock));
+} /* -- sr_mbuf_pool_dump -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_get(..)
+ * Scope: Global
+ *
+ * A buffer with one reference, from this thread's free list if it has
+ * one.  0 if the pool can't grow.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_mbuf* sr_mbuf_get(struct sr_mbuf_pool* pool)
+{
+    struct sr_mbuf_cache* cache;
+    struct sr_mbuf* m;
+
+    assert(pool);
+
+    cache = &(sr_mbuf_caches[pool->id]);
+    cache->gets = 1;
+    if(cache->head == 0)
+    {
+        /* -- refill half way from the shared list -- */
+        pthread_mutex_lock(&(pool->lock));
+        if(pool->nfree == 0)
+        { sr_mbuf_grow(pool); }
+        while(pool->free && cache->n < SR_MBUF_CACHE / 2)
+        {
+            m = pool->free;
+            pool->free = m->next;
+            pool->nfree--;
+            m->next = cache->head;
+            cache->head = m;
+            cache->n++;
+        }
+        pthread_mutex_unlock(&(pool->lock));
+
+        if(cache->head == 0)
+        { return 0; }
+    }
+
+    m = cache->head;
+    cache->head = m->next;
+    cache->n--;
+    m->next = 0;
+    m->refcnt = 1;
+    return m;
+} /* -- sr_mbuf_get -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_ref(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_mbuf_ref(struct sr_mbuf* m)
+{
+    assert(m);
+
+    __atomic_add_fetch(&(m->refcnt), 1, __ATOMIC_RELAXED);
+} /* -- sr_mbuf_ref -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_put(..)
+ * Scope: Global
+ *
+ * Drops a reference.  The last one puts the buffer on this thread's free
+ * list, and half of that back on the shared one if it's grown too long;
+ * straight on the shared one if this thread never gets buffers of the
+ * pool, as the ARP and timer threads mostly only drop them.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_mbuf_put(struct sr_mbuf* m)
+{
+    struct sr_mbuf_pool* pool;
+    struct sr_mbuf_cache* cache;
+    struct sr_mbuf* first;
+    struct sr_mbuf* last;
+    uint32_t n;
+
+    assert(m);
+
+    if(__atomic_sub_fetch(&(m->refcnt), 1, __ATOMIC_ACQ_REL) != 0)
+    { return; }
+
+    pool = m->pool;
+    cache = &(sr_mbuf_caches[pool->id]);
+    if(!cache->gets)
+    {
+        /* -- it would be stranded with a thread that never takes any -- */
+        pthread_mutex_lock(&(pool->lock));
+        m->next = pool->free;
+        pool->free = m;
+        pool->nfree++;
+        pthread_mutex_unlock(&(pool->lock));
+        return;
+    }
+
+    m->next = cache->head;
+    cache->head = m;
+    if(++cache->n <= SR_MBUF_CACHE)
+    { return; }
+
+    /* -- hand back all but half, in one go -- */
+    first = last = cache->head;
+    for(n = 1; n < cache->n - SR_MBUF_CACHE / 2; n++)
+    { last = last->next; }
+    cache->head = last->next;
+    cache->n -= n;
+
+    pthread_mutex_lock(&(pool->lock));
+    last->next = pool->free;
+    pool->free = first;
+    pool->nfree += n;
+    pthread_mutex_unlock(&(pool->lock));
+} /* -- sr_mbuf_put -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_shared(..)
+ * Scope: Global
+ *
+ * Whether anyone besides the caller holds a reference to m
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_mbuf_shared(struct sr_mbuf* m)
+{
+    assert(m);
+
+    return __atomic_load_n(&(m->refcnt), __ATOMIC_ACQUIRE) > 1;
+} /* -- sr_mbuf_shared -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_frames(..)
+ * Scope: Global
+ *
+ * The pool of SR_MBUF_FRAME byte buffers for frames that don't come
+ * from the server, set up on first use
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_mbuf_frames_init(void)
+{
+    if(sr_mbuf_pool_init(&sr_mbuf_frame_pool, "frames", SR_MBUF_FRAME,
+                         SR_MBUF_FRAMES) != 0)
+    { abort(); }
+}
+
+struct sr_mbuf_pool* sr_mbuf_frames(void)
+{
+    pthread_once(&sr_mbuf_frame_once, sr_mbuf_frames_init);
+    return &sr_mbuf_frame_pool;
+} /* -- sr_mbuf_frames -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_mbuf_keep(..)
+ * Scope: Global
+ *
+ * A buffer holding the len byte frame at *buf, for whoever keeps it past
+ * the call it was lent for, with a reference for the caller.  m, the
+ * buffer it is in (0 if none), is shared if it is no bigger than a
+ * buffer of sr_mbuf_frames(); else the frame is copied into one of those
+ * and *buf moved there, so that a frame never holds a receive buffer
+ * (see sr_mbuf.h).  0 if the frame is too long, which is counted in the
+ * pool's oversize, or there is no buffer.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_mbuf* sr_mbuf_keep(struct sr_mbuf* m, uint8_t** buf,
+                             unsigned int len)
+{
+    struct sr_mbuf_pool* frames = sr_mbuf_frames();
+
+    assert(buf);
+
+    if(m && m->size <= SR_MBUF_FRAME)
+    {
+        sr_mbuf_ref(m);
+        return m;
+    }
+
+    if(len > SR_MBUF_FRAME)
+    {
+        __atomic_add_fetch(&(frames->oversize), 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if((m = sr_mbuf_get(frames)) == 0)
+    { return 0; }
+
+    memcpy(m->data, *buf, len);
+    *buf = m->data;
+    return m;
+} /* -- sr_mbuf_keep -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_pool_alloc(..)
+ * Scope: Global
+ *
+ * A buffer's data as an object of the pool's size, 0 if out of memory
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_pool_alloc(struct sr_mbuf_pool* pool)
+{
+    struct sr_mbuf* m = sr_mbuf_get(pool);
+
+    return m ? m->data : 0;
+} /* -- sr_pool_alloc -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_pool_free(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_pool_free(void* obj)
+{
+    assert(obj);
+
+    sr_mbuf_put((struct sr_mbuf*)((uint8_t*)obj - SR_MBUF_HDR));
+} /* -- sr_pool_free -- */
@@ -0,0 +1,115 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_mbuf.h
+ *
+ * Description:
+ *
+ * Pools of fixed size, reference counted buffers, so that nothing on the
+ * way from the server, through a wait for ARP, and back to the server
+ * calls the general purpose allocator.
+ *
+ * A pool carves its buffers out of slabs of SR_MBUF_SLAB bytes, or of
+ * as many buffers as it is set up with if that's more, as many slabs as
+ * it needs when it is set up and another whenever it runs dry.  Slabs
+ * come from sr_arena_alloc(), so those of half a hugepage or more are
+ * on hugepages and hold as many buffers as fit in the whole hugepages
+ * they are rounded up to.  Each buffer is an SR_MBUF_HDR byte
+ * header followed by its data, both aligned to a cache line, and is
+ * handed out with one reference.  The last
+ * sr_mbuf_put() returns it to a free list of the calling thread's own;
+ * only when that holds more than SR_MBUF_CACHE buffers, or is empty when
+ * one is wanted, is the pool's shared list locked, and then for half of
+ * SR_MBUF_CACHE buffers at a time.
+ *
+ * Packets live in the buffers the reader receives into (see sr_vns_comm.c):
+ * a frame sits right behind the VNS header it arrived with, which is
+ * headroom enough to send it back out.  A packet forwarded to a known
+ * neighbor is written out from there, uncopied, before the reader reads
+ * into that buffer again.
+ *
+ * The one copy left is for a frame kept past that: waiting for ARP, or
+ * in an egress queue.  sr_mbuf_keep() shares the buffer it is in only if
+ * that is frame sized, and otherwise copies it into an SR_MBUF_FRAME
+ * byte buffer of the shared pool sr_mbuf_frames().  A receive buffer is
+ * SR_RX_BUF bytes holding many frames, so sharing it would let each kept
+ * frame hold up to that much, and what the ARP queue and egress queues
+ * are allowed to keep would be off by that factor; copying a frame that
+ * is about to wait a round trip or more costs little by comparison.
+ * Frames too long for a frame buffer are not kept, and counted.  The
+ * frames the router makes itself are in those buffers from the start.
+ *
+ * The same pools give out fixed size objects, e.g. queue entries,
+ * through sr_pool_alloc() and sr_pool_free().
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_MBUF_H
+#define sr_MBUF_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SR_MBUF_ALIGN 64   /* cache line */
+#define SR_MBUF_HDR   64   /* header, rounded up to SR_MBUF_ALIGN */
+#define SR_MBUF_SLAB  (256 * 1024) /* bytes a pool grows by */
+#define SR_MBUF_CACHE 32   /* buffers a thread keeps for itself */
+#define SR_MBUF_POOLS 8    /* pools there may be */
+#define SR_MBUF_FRAME 2048 /* data in a buffer of sr_mbuf_frames() */
+#define SR_MBUF_FRAMES 512 /* of them to start with, a hugepage */
+
+struct sr_mbuf_pool;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_mbuf
+ *
+ * Header of a buffer; the data follows at SR_MBUF_HDR bytes in
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_mbuf
+{
+    struct sr_mbuf* next; /* on a free list */
+    struct sr_mbuf_pool* pool;
+    uint32_t refcnt;
+    uint32_t size;        /* bytes at data */
+    uint8_t* data;
+};
+
+struct sr_mbuf_pool
+{
+    const char* name;
+    int id;               /* slot in each thread's caches */
+    size_t size;          /* data in each buffer */
+    size_t stride;        /* header and data, rounded to SR_MBUF_ALIGN */
+    size_t slab;          /* bytes asked for per slab */
+    pthread_mutex_t lock;
+    struct sr_mbuf* free; /* shared free list */
+    uint32_t nfree;
+    uint32_t nbufs;       /* buffers carved out so far */
+    uint32_t nslabs;
+    unsigned long oversize; /* frames too long to keep, see sr_mbuf_keep */
+};
+
+int  sr_mbuf_pool_init(struct sr_mbuf_pool*, const char* name, size_t size,
+                       uint32_t count);
+void sr_mbuf_pool_dump(struct sr_mbuf_pool*);
+
+struct sr_mbuf* sr_mbuf_get(struct sr_mbuf_pool*);
+void sr_mbuf_ref(struct sr_mbuf*);
+void sr_mbuf_put(struct sr_mbuf*);
+int  sr_mbuf_shared(struct sr_mbuf*);
+
+struct sr_mbuf_pool* sr_mbuf_frames(void);
+struct sr_mbuf* sr_mbuf_keep(struct sr_mbuf*, uint8_t** buf, unsigned int len);
+
+void* sr_pool_alloc(struct sr_mbuf_pool*);
+void  sr_pool_free(void*);
+
+#endif  /* --  sr_MBUF_H -- */
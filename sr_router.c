@@ -12,15 +12,20 @@
  **********************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <signal.h>
 
 
 #include "sr_if.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_router.h"
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_utils.h"
+#include "sr_snapshot.h"
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -37,6 +42,10 @@ void sr_init(struct sr_instance* sr)
 
     /* Initialize cache and cache cleanup thread */
     sr_arpcache_init(&(sr->cache));
+    sr_arpcache_set_max(&(sr->cache), sr->arp_max);
+    sr_arpcache_set_queue(&(sr->cache), sr->arpq_max, sr->arpq_policy,
+                          sr->arpq_budget);
+    sr_flowcache_init(&(sr->flows));
 
     pthread_attr_init(&(sr->attr));
     pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
@@ -44,47 +53,112 @@ void sr_init(struct sr_instance* sr)
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
     pthread_t thread;
 
+    /* SIGHUP is only taken by the reload thread, and SIGINT and SIGTERM by
+       the snapshot thread if there is one (threads inherit the mask) */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    if(sr->snapshot[0]) {
+      sigaddset(&set, SIGINT);
+      sigaddset(&set, SIGTERM);
+    }
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
     pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+    pthread_create(&thread, &(sr->attr), sr_rt_reload_thread, sr);
+
+    if(sr->snapshot[0])
+      pthread_create(&thread, &(sr->attr), sr_snapshot_thread, sr);
 
     /* Add initialization code here! */
 
 } /* -- sr_init -- */
 
 /*---------------------------------------------------------------------
- * Method: sr_handlepacket(uint8_t* p,char* interface)
+ * Method: sr_arp_learn(..)
+ * Scope:  Local
+ *
+ * Caches the sender's IP->MAC mapping from an ARP packet received on
+ * interface ifid.  If packets were waiting on that IP they are addressed and
+ * sent, in the order they arrived.  Probes (RFC 5227, sender IP 0.0.0.0)
+ * and packets claiming one of our own addresses teach nothing, and
+ * caching them would only bump arp_gen and drop every cached flow.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_arp_learn(struct sr_instance* sr,
+        sr_arp_hdr_t* arphdr,
+        int ifid)
+{
+  struct sr_arpcache *arp_cache = &(sr->cache);
+  struct sr_arpreq *req;
+  struct sr_packet *pkt;
+  int i;
+
+  if(arphdr->ar_sip == 0) {
+    printf("\tARP probe, nothing to learn\n");
+    return;
+  }
+  for(i = 0; i < sr->nifs; i++)
+    if(arphdr->ar_sip == sr->if_table[i]->ip) {
+      fprintf(stderr, "ARP from another host with our address\n");
+      return;
+    }
+
+  /* cache IP->MAC mapping and check if arp req in queue */
+  req = sr_arpcache_insert(arp_cache,arphdr->ar_sha,arphdr->ar_sip,ifid);
+  if(req != NULL) {
+    /* address the whole backlog and send it in arrival order */
+    printf("\tARP req in queue, %u packets waiting\n",req->npackets);
+    for(pkt = req->packets; pkt != NULL; pkt = pkt->next)
+      memcpy(((sr_ethernet_hdr_t *)pkt->buf)->ether_dhost,arphdr->ar_sha,6);
+    sr_send_packet_list(sr,req->packets);
+    sr_arpreq_destroy(arp_cache,req);
+  }
+  else
+    printf("\tARP req not in queue\n");
+} /* -- sr_arp_learn -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handlepacket(uint8_t* p,int ifid)
  * Scope:  Global
  *
  * This method is called each time the router receives a packet on the
  * interface.  The packet buffer, the packet length and the receiving
- * interface are passed in as parameters. The packet is complete with
- * ethernet headers.
+ * interface's number are passed in as parameters. The packet is complete
+ * with ethernet headers.
  *
- * Note: Both the packet buffer and the character's memory are handled
- * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
- * packet instead if you intend to keep it around beyond the scope of
+ * Note: The packet buffer is handled by sr_vns_comm.c that means do NOT
+ * delete it.  It is in sr->rx_mbuf; keep it with sr_mbuf_keep() (see
+ * sr_mbuf.h) if you intend to keep the packet around beyond the scope of
  * the method call.
  *
+ * Forwarded packets and ARP replies are rewritten in the buffer itself
+ * and queued to be sent from it, so nothing on the way through is
+ * copied; only packets that wait for ARP are, into a frame sized buffer.
+ *
  *---------------------------------------------------------------------*/
 
 void sr_handlepacket(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        int ifid)
 {
-  uint8_t buf[len];
-  int cksumtemp = 0;
-  int cksumcalculated = 0;
-  struct sr_arpentry *entry;
+  int cksumgood = 0;
+  uint16_t ttlword = 0;
+  unsigned char mac[ETHER_ADDR_LEN];
   struct sr_arpreq *req;
   struct sr_arpcache *arp_cache = &(sr->cache);
   struct sr_if *sr_interface;
-  struct sr_rt *rt_walker = 0;
-  char *temp_if;
+  struct sr_fib_nh *nh;
+  struct sr_adj *adj;
+  struct sr_rt_table *table;
+  struct sr_flowentry *flow;
+  uint32_t rt_gen, arp_gen, arp_round, next_hop;
 
   /* REQUIRES */
   assert(sr);
   assert(packet);
-  assert(interface);
 
   printf("\n*** -> Received packet of length %d \n",len);
 
@@ -94,11 +168,6 @@ void sr_handlepacket(struct sr_instance* sr,
   sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
   sr_icmp_hdr_t *icmphdr = (sr_icmp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
 
-  sr_ethernet_hdr_t *arpreply_ethhdr = (sr_ethernet_hdr_t *)buf;
-  sr_arp_hdr_t *arpreply_arphdr = (sr_arp_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
-
-  sr_ethernet_hdr_t *tempreq;
-
   if (len < sizeof(sr_ethernet_hdr_t)) {
     fprintf(stderr, "ETHERNET header is insufficient length\n");
     return;
@@ -114,38 +183,38 @@ void sr_handlepacket(struct sr_instance* sr,
       printf("ARP packet received\n");
       if(ntohs(arphdr->ar_op) == arp_op_request) { /* ARP request */
 	printf("\tARP request\n");
-	/* send ARP reply */
-	sr_interface = sr_get_interface(sr,interface);
-	memcpy(buf,packet,len);
+	sr_interface = sr_get_interface_id(sr,ifid);
+	if(arphdr->ar_sip == arphdr->ar_tip) { /* gratuitous, nobody to answer */
+	  printf("\tgratuitous ARP\n");
+	  if(sr->arp_garp)
+	    sr_arp_learn(sr,arphdr,ifid);
+	  return;
+	}
+	if(arphdr->ar_tip != sr_interface->ip) {
+	  printf("\tARP request not for us\n");
+	  return;
+	}
 
-	memset(arpreply_ethhdr->ether_dhost,0xff,6);
-	memcpy(arpreply_ethhdr->ether_shost,sr_interface->addr,6);
-	arpreply_ethhdr->ether_type = htons(ethertype_arp);
+	/* the sender will talk to us next, so learn it now (RFC 826) */
+	sr_arp_learn(sr,arphdr,ifid);
 
-	arpreply_arphdr->ar_op = htons(arp_op_reply);
-	memcpy(arpreply_arphdr->ar_sha,sr_interface->addr,6);
-	arpreply_arphdr->ar_sip = arphdr->ar_tip;
-	memcpy(arpreply_arphdr->ar_tha,arphdr->ar_sha,6);
-	arpreply_arphdr->ar_tip = arphdr->ar_sip;
-	sr_send_packet(sr,buf,len,interface);
+	/* send ARP reply, turning the request around where it is */
+	memset(ethhdr->ether_dhost,0xff,6);
+	memcpy(ethhdr->ether_shost,sr_interface->addr,6);
+
+	arphdr->ar_op = htons(arp_op_reply);
+	memcpy(arphdr->ar_tha,arphdr->ar_sha,6);
+	arphdr->ar_tip = arphdr->ar_sip;
+	memcpy(arphdr->ar_sha,sr_interface->addr,6);
+	arphdr->ar_sip = sr_interface->ip;
+	sr_queue_packet_id(sr,packet,len,ifid,sr->rx_mbuf);
 
 	printf("\tARP reply sent\n");
 		/* sr_arpcache_dump(arp_cache); */
       }
       else if(ntohs(arphdr->ar_op) == arp_op_reply) { /* ARP reply */
 	printf("\tARP reply\n");
-	/* cache IP->MAC mapping and check if arp req in queue */
-	req = sr_arpcache_insert(arp_cache,arphdr->ar_sha,ntohs(arphdr->ar_sip));
-	tempreq = (sr_ethernet_hdr_t *)req->packets->buf;
-	memcpy(tempreq->ether_dhost,ethhdr->ether_shost,6);
-	if(req != NULL) {
-	  /* send outstanding packets by call */
-	  printf("\tARP req in queue\n");
-	  sr_send_packet(sr,req->packets->buf,req->packets->len,interface);
-	  sr_arpreq_destroy(arp_cache,req);
-	}
-	else
-	  printf("\tARP req not in queue\n");
+	sr_arp_learn(sr,arphdr,ifid);
       }
       else /* not ARP request or reply */
 	fprintf(stderr, "Unknown ARP opcode\n");
@@ -159,74 +228,114 @@ void sr_handlepacket(struct sr_instance* sr,
     }
     else {
       printf("IP packet received\n");
-      /* check checksum */
-      cksumtemp = iphdr->ip_sum;
-      iphdr->ip_sum = 0;
-      cksumcalculated = cksum((void *)iphdr,4*iphdr->ip_hl);
-
-      if(cksumtemp == cksumcalculated) {
-	printf("\tChecksum good!\n");
+      /* check checksum, on every packet or 1 in ip_verify (see -C); over
+	 a good header, checksum field included, it sums to all ones */
+      cksumgood = 1;
+      if(sr->ip_verify && sr->ip_seen % sr->ip_verify == 0) {
+	sr->ip_checked++;
+	cksumgood = (cksum((void *)iphdr,4*iphdr->ip_hl) == 0xffff);
+	if(cksumgood)
+	  printf("\tChecksum good!\n");
+	else
+	  sr->ip_bad++;
+      }
+      sr->ip_seen++;
 
+      if(cksumgood) {
 	/* this part should not be here, it should be called though */
 	if(iphdr->ip_ttl <= 1) {
 	  fprintf(stderr, "ICMP time exceeded\n"); /* ICMP time exceeded */
 	  return;
 	}
-	else
-	  iphdr->ip_ttl -= 1; 
-	
-	/* update checksum */
-	iphdr->ip_sum = cksum((void *)iphdr,4*iphdr->ip_hl);
-
-	/* todo: LPM and find next hop ip, if no match ICMP net unreachable  */
-
-	/* check routing table, save interface */
-	rt_walker = sr->routing_table;
-	while(rt_walker != NULL) {
-	  if(iphdr->ip_dst == (uint32_t)rt_walker->dest.s_addr) { /* checks for dest IP addr, should be LPM ip not ip_dst */
-	    temp_if = rt_walker->interface;
+
+	/* update checksum for the TTL alone, it shares a word with ip_p */
+	ttlword = htons(iphdr->ip_ttl << 8 | iphdr->ip_p);
+	iphdr->ip_ttl -= 1;
+	iphdr->ip_sum = cksum_update(iphdr->ip_sum,ttlword,
+				     htons(iphdr->ip_ttl << 8 | iphdr->ip_p));
+
+	/* a cached forwarding decision skips route, interface and ARP lookups */
+	table = sr_rt_current(sr); /* read before the lookups, see sr_flowcache.h */
+	rt_gen = table ? table->gen : 0;
+	arp_gen = sr_arpcache_generation(arp_cache);
+	arp_round = sr_arpcache_round(arp_cache);
+	flow = sr_flowcache_lookup(&(sr->flows),iphdr->ip_dst,rt_gen,arp_gen);
+	if(flow != NULL) {
+	  if(flow->arp_round != arp_round) { /* keep the entry refreshed */
+	    sr_arpcache_lookup_mac(arp_cache,flow->next_hop,mac);
+	    flow->arp_round = arp_round;
 	  }
-	  rt_walker = rt_walker->next;
+	  memcpy(ethhdr,&(flow->eth),sizeof(sr_ethernet_hdr_t));
+	  sr_queue_packet_id(sr,packet,len,flow->ifid,sr->rx_mbuf);
+	  return;
 	}
-	sr_interface = sr_get_interface(sr,temp_if);
 
-	/* check cache to avoid unnecessary arp req */
-	entry = sr_arpcache_lookup(arp_cache,ntohs(iphdr->ip_dst)); /* should be LPM ip not ip_dst, but since next hop is destination... */
+	/* longest prefix match on the destination gives the next hop */
+	nh = table ? sr_fib_find(table->fib,iphdr->ip_dst) : NULL;
+	if(nh == NULL) {
+	  fprintf(stderr, "ICMP net unreachable\n");
+	  return;
+	}
+	adj = sr_rt_adj(table,nh);
+	if(!adj->bound) { /* the route's one name lookup */
+	  adj->ifid = sr_interface_id(sr,nh->interface);
+	  adj->bound = 1;
+	}
+	sr_interface = sr_get_interface_id(sr,adj->ifid);
+	if(sr_interface == 0) { /* route through an interface we don't have */
+	  fprintf(stderr, "ICMP host unreachable\n");
+	  return;
+	}
+	next_hop = nh->gw.s_addr ? nh->gw.s_addr : iphdr->ip_dst;
+
+	/* every route through a gateway shares its resolved header */
+	if(adj->resolved && adj->arp_gen == arp_gen) {
+	  printf("\tadjacency hit\n");
+	  if(adj->arp_round != arp_round) {
+	    sr_arpcache_lookup_mac(arp_cache,next_hop,mac);
+	    adj->arp_round = arp_round;
+	  }
+	  memcpy(ethhdr,&(adj->eth),sizeof(sr_ethernet_hdr_t));
+	  sr_queue_packet_id(sr,packet,len,adj->ifid,sr->rx_mbuf);
+	  sr_flowcache_insert(&(sr->flows),iphdr->ip_dst,rt_gen,arp_gen,
+			      sr_interface,next_hop,arp_round,adj->eth.ether_dhost);
+	  return;
+	}
 
-	if(entry != NULL) { /* cache hit, just send ip packet to next hop*/
+	/* check cache to avoid unnecessary arp req */
+	if(sr_arpcache_lookup_mac(arp_cache,next_hop,mac)) { /* cache hit, just send ip packet to next hop*/
 	  printf("\tIP->MAC hit\n");
-	  sr_send_packet(sr,packet,len,sr_interface);
-	  free(entry);
+	  memcpy(ethhdr->ether_dhost,mac,6);
+	  memcpy(ethhdr->ether_shost,sr_interface->addr,6);
+	  if(nh->gw.s_addr) { /* directly connected hosts each have their own */
+	    memcpy(&(adj->eth),ethhdr,sizeof(sr_ethernet_hdr_t));
+	    adj->arp_gen = arp_gen;
+	    adj->arp_round = arp_round;
+	    adj->resolved = 1;
+	  }
+	  sr_queue_packet_id(sr,packet,len,adj->ifid,sr->rx_mbuf);
+	  sr_flowcache_insert(&(sr->flows),iphdr->ip_dst,rt_gen,arp_gen,
+			      sr_interface,next_hop,arp_round,mac);
+	}
+	else if(sr_arpcache_unreachable(arp_cache,next_hop)) { /* gave up on it lately */
+	  fprintf(stderr, "ICMP host unreachable\n");
 	}
 	else { /* cache miss, send ARP req and wait for reply */
 	  printf("\tIP->MAC miss\n");
-	  if(sr_interface == 0) { /* no match in routing table */
-	    fprintf(stderr, "ICMP host unreachable\n");
-	    return;
-	  }
-	  else { /* match in routing table */
-	    /* construct arp req with new interface */
-	    memset(arpreply_ethhdr->ether_dhost,0xff,6);
-	    memcpy(arpreply_ethhdr->ether_shost,sr_interface->addr,6);
-	    arpreply_ethhdr->ether_type = htons(ethertype_arp);
-
-	    arpreply_arphdr->ar_hrd = htons(arp_hrd_ethernet);
-	    arpreply_arphdr->ar_pro = htons(ethertype_ip);
-	    arpreply_arphdr->ar_hln = 0x6;
-	    arpreply_arphdr->ar_pln = 0x4;
-	    arpreply_arphdr->ar_op = htons(arp_op_request);
-	    memcpy(arpreply_arphdr->ar_sha,sr_interface->addr,6);
-	    arpreply_arphdr->ar_sip = sr_interface->ip;
-	    memset(arpreply_arphdr->ar_tha,0x00,6);
-	    arpreply_arphdr->ar_tip = iphdr->ip_dst;
-
-	    memcpy(ethhdr->ether_shost,sr_interface->addr,6);
-
+	  memcpy(ethhdr->ether_shost,sr_interface->addr,6);
+
+	  /* add packet to queue list, the first for an IP sends the ARP req */
+	  pthread_mutex_lock(&(arp_cache->lock));
+	  req = sr_arpcache_queuereq(arp_cache,next_hop,packet,len,adj->ifid,
+				     sr->rx_mbuf);
+	  if(req != NULL && req->tries == 0) { /* new, the timer has the rest */
+	    handle_arpreq(sr,req);
+	    pthread_mutex_unlock(&(arp_cache->lock));
+	    sr_arpcache_send_requests(sr); /* not under the lock */
 	    printf("\tARP request sent\n");
-	    /* add packet to queue list */
-	    req = sr_arpcache_queuereq(arp_cache,ntohs(iphdr->ip_dst),packet,len,sr_interface);
-	    handle_arpreq(arp_cache,sr,req,buf,sr_interface);
 	  }
+	  else
+	    pthread_mutex_unlock(&(arp_cache->lock));
 	}
       }
       else {
@@ -241,3 +350,31 @@ void sr_handlepacket(struct sr_instance* sr,
     printf("Unrecognized Ethernet Type 0x%X\n",ethertype(packet));
 }
 /* end sr_ForwardPacket */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handlepackets(..)
+ * Scope:  Global
+ *
+ * Hands a batch of frames to sr_handlepacket, in order, under a single
+ * epoch read section, then writes out what they queued to send.  The
+ * frames are lent, as for sr_handlepacket.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_handlepackets(struct sr_instance* sr,
+        struct sr_frame* frames/* lent */,
+        int n)
+{
+  int i;
+
+  /* REQUIRES */
+  assert(sr);
+  assert(frames);
+
+  sr_epoch_enter(&(sr->epoch));
+  for(i = 0; i < n; i++)
+    sr_handlepacket(sr,frames[i].buf,frames[i].len,frames[i].ifid);
+  sr_epoch_exit(&(sr->epoch));
+
+  sr_flush_packets(sr);
+} /* -- sr_handlepackets -- */
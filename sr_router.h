@@ -10,11 +10,17 @@
 #define SR_ROUTER_H
 
 #include <netinet/in.h>
+#include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <stdio.h>
 
 #include "sr_protocol.h"
+#include "vnscommand.h"
 #include "sr_arpcache.h"
+#include "sr_flowcache.h"
+#include "sr_epoch.h"
+#include "sr_egress.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -30,9 +36,56 @@
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
 
+#define SR_VNS_CMD_MAX 10000     /* longest command the server sends */
+#define SR_RX_BUF      (64 * 1024) /* bytes read from the server at once */
+#define SR_RX_BATCH    64        /* packets handed to the router at once */
+#define SR_RX_POOL     16        /* receive buffers to start with, a hugepage */
+#define SR_TXQ_MAX     64        /* packets sent to the server at once */
+#define SR_TXQ_BYTES   (32 * 1024) /* and the bytes they may add up to */
+
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_rt_table;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_frame
+ *
+ * A received Ethernet frame, still in the receive buffer
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_frame
+{
+    uint8_t* buf;
+    unsigned int len;
+    int ifid; /* interface it came in on */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_txq
+ *
+ * Frames on their way to the server, each behind its VNS header.  They
+ * go in a single writev when the queue reaches max_frames or max_bytes,
+ * and at the latest once the batch of packets that queued them has been
+ * handled (see sr_queue_packet_id).  What the server doesn't take moves
+ * to the egress queues (see sr_egress.h).
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_txq
+{
+    c_packet_header hdrs[SR_TXQ_MAX];
+    struct iovec iov[2 * SR_TXQ_MAX];
+    int ifid[SR_TXQ_MAX];
+    struct sr_mbuf* mbuf[SR_TXQ_MAX]; /* buffer each frame is in, or 0 */
+    int n;
+    size_t bytes;
+    int max_frames; /* 1 writes every frame on its own */
+    size_t max_bytes;
+    unsigned long writes; /* writes to the server, and frames they held */
+    unsigned long frames;
+};
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -44,15 +97,48 @@ struct sr_rt;
 struct sr_instance
 {
     int  sockfd;   /* socket to server */
+    struct sr_mbuf_pool rx_pool; /* SR_RX_BUF byte buffers to read into */
+    struct sr_mbuf* rx_mbuf; /* the one being read into, see sr_vns_comm.c */
+    uint8_t* rx_buf; /* its data */
+    size_t rx_start; /* commands not yet handled start here */
+    size_t rx_end;
+    unsigned long rx_reads; /* reads from sockfd, and packets they held */
+    unsigned long rx_frames;
     char user[32]; /* user name */
     char host[32]; /* host name */
     char template[30]; /* template name if any */
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
-    struct sr_rt* routing_table; /* routing table */
+    struct sr_if* if_table[SR_IF_MAX]; /* the same, by number */
+    int nifs;
+    struct sr_rt_table* rt; /* routing table, replaced whole on change */
+    pthread_mutex_t rt_lock; /* serialises routing table writers */
+    struct sr_epoch epoch; /* read sections for lock free readers of rt */
+    int fib_engine; /* lookup engine the fib is built with */
+    uint32_t rt_gen; /* last generation given to a routing table */
+    char rtable[256]; /* file the routing table was loaded from */
+    uint32_t rt_file_gen; /* generation of the table loaded from rtable */
+    off_t rt_size; /* rtable's size and SHA-1 when it was loaded */
+    uint32_t rt_digest[5]; /* SR_RT_DIGEST words */
+    char snapshot[256]; /* warm start snapshot, empty for none */
+    uint32_t snap_gen; /* generation of the table last saved to it */
     struct sr_arpcache cache;   /* ARP cache */
+    uint32_t arp_max; /* most mappings the ARP cache holds */
+    uint32_t arpq_max; /* packets queued per pending ARP request */
+    int arpq_policy; /* SR_ARPQ_DROP_NEWEST or _OLDEST */
+    size_t arpq_budget; /* bytes queued over all ARP requests */
+    int arp_garp; /* learn mappings from gratuitous ARP too */
+    struct sr_flowcache flows;  /* cached forwarding decisions */
+    unsigned long ip_verify; /* check 1 in this many IP checksums, 0 none */
+    unsigned long ip_seen; /* IP packets, to pick which ones to check */
+    unsigned long ip_checked; /* checksums checked, and found bad */
+    unsigned long ip_bad;
     pthread_attr_t attr;
+    pthread_mutex_t send_lock; /* one frame at a time onto sockfd */
+    struct sr_txq txq; /* under send_lock */
+    struct sr_egress egress; /* under send_lock */
+    int tx_wake[2]; /* pipe that wakes the reader to drain egress */
     FILE* logfile;
 };
 
@@ -61,12 +147,18 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_send_packet_id(struct sr_instance* , uint8_t* , unsigned int , int );
+int sr_send_packet_list(struct sr_instance* , struct sr_packet* );
+int sr_queue_packet_id(struct sr_instance* , uint8_t* , unsigned int , int ,
+                       struct sr_mbuf* );
+int sr_flush_packets(struct sr_instance* );
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
-void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
+void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , int );
+void sr_handlepackets(struct sr_instance* , struct sr_frame* , int );
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
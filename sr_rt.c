@@ -12,124 +12,790 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
 
 
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #define __USE_MISC 1 /* force linux to show inet_aton */
 #include <arpa/inet.h>
 
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_router.h"
+#include "sha1.h"
+
+/* Routes shown by sr_print_routing_table, full tables run to millions */
+#define SR_RT_PRINT_MAX 64
+
+/* Text loads: at most this many parser threads, each given at least
+ * SR_RT_LOAD_CHUNK_MIN bytes of the file; the first SR_RT_LOAD_BAD_MAX
+ * malformed lines are reported individually */
+#define SR_RT_LOAD_THREADS   16
+#define SR_RT_LOAD_CHUNK_MIN (256 * 1024)
+#define SR_RT_LOAD_BAD_MAX   16
+
+/* One parser thread's share of a text load */
+struct sr_rt_chunk
+{
+    const char*   start;
+    const char*   end;
+    struct sr_rt* routes;   /* parsed routes, in file order */
+    uint32_t      nroutes;
+    uint32_t      cap;
+    uint32_t      lines;
+    uint32_t      nbad;
+    uint32_t      bad[SR_RT_LOAD_BAD_MAX]; /* line numbers in the chunk */
+    int           nomem;
+};
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_rt_table_create(..)
+ * Scope: Global
+ *
+ * Allocate an empty, unpublished routing table
  *
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+struct sr_rt_table* sr_rt_table_create(int engine)
 {
-    FILE* fp;
-    char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
-    struct in_addr dest_addr;
-    struct in_addr gw_addr;
-    struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    struct sr_rt_table* table = 0;
+
+    table = (struct sr_rt_table*)calloc(1, sizeof(struct sr_rt_table));
+    if(table == 0)
+    { return 0; }
+
+    if((table->fib = sr_fib_create(engine)) == 0)
+    {
+        free(table);
+        return 0;
+    }
+
+    return table;
+} /* -- sr_rt_table_create -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_table_destroy(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_table_destroy(struct sr_rt_table* table)
+{
+    if(table == 0)
+    { return; }
+
+    sr_fib_destroy(table->fib);
+    free(table->adj);
+    free(table);
+} /* -- sr_rt_table_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_table_add(..)
+ * Scope: Global
+ *
+ * Append a route to an unpublished table and compile it into the
+ * table's FIB.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_table_add(struct sr_rt_table* table, struct in_addr dest,
+        struct in_addr gw, struct in_addr mask, const char* if_name)
+{
+    struct sr_rt entry;
 
     /* -- REQUIRES -- */
-    assert(filename);
-    if( access(filename,R_OK) != 0)
+    assert(table);
+    assert(if_name);
+
+    memset(&entry, 0, sizeof(struct sr_rt));
+    entry.dest = dest;
+    entry.gw   = gw;
+    entry.mask = mask;
+    strncpy(entry.interface,if_name,sr_IFACE_NAMELEN - 1);
+
+    if(sr_fib_insert(table->fib, &entry) != 0)
     {
-        perror("access");
+        fprintf(stderr,"Error adding route to forwarding table\n");
         return -1;
     }
 
-    fp = fopen(filename,"r");
+    return 0;
+} /* -- sr_rt_table_add -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse_ip(..)
+ * Scope: Local
+ *
+ * Parse a dotted quad at *p, leaving *p just past it.  Returns the
+ * address in network byte order in *ip, or -1 if *p doesn't start with
+ * four decimal octets followed by a blank or the end of the line.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_parse_ip(const char** p, const char* end, uint32_t* ip)
+{
+    const char* c = *p;
+    uint32_t addr = 0;
+    uint32_t octet;
+    int i, digits;
+
+    for(i = 0; i < 4; i++)
+    {
+        if(i > 0)
+        {
+            if(c == end || *c != '.')
+            { return -1; }
+            c++;
+        }
+        octet = 0;
+        for(digits = 0; c < end && *c >= '0' && *c <= '9'; digits++, c++)
+        { octet = octet * 10 + (*c - '0'); }
+        if(digits == 0 || digits > 3 || octet > 255)
+        { return -1; }
+        addr = (addr << 8) | octet;
+    }
+
+    if(c < end && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n')
+    { return -1; }
+
+    *ip = htonl(addr);
+    *p = c;
+    return 0;
+} /* -- sr_rt_parse_ip -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_skip_blanks(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------*/
+
+static const char* sr_rt_skip_blanks(const char* c, const char* end)
+{
+    while(c < end && (*c == ' ' || *c == '\t' || *c == '\r'))
+    { c++; }
+    return c;
+} /* -- sr_rt_skip_blanks -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse_line(..)
+ * Scope: Local
+ *
+ * Parse "dest gw mask iface" from one line (without its newline).
+ * Returns 1 for a route, 0 for a blank or # comment line and -1 if the
+ * line is malformed.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_parse_line(const char* c, const char* end,
+                            struct sr_rt* entry)
+{
+    const char* name;
+
+    c = sr_rt_skip_blanks(c, end);
+    if(c == end || *c == '#')
+    { return 0; }
+
+    /* -- cleared whole so that images built from it are reproducible -- */
+    memset(entry, 0, sizeof(struct sr_rt));
+    if(sr_rt_parse_ip(&c, end, &entry->dest.s_addr) != 0)
+    { return -1; }
+    c = sr_rt_skip_blanks(c, end);
+    if(sr_rt_parse_ip(&c, end, &entry->gw.s_addr) != 0)
+    { return -1; }
+    c = sr_rt_skip_blanks(c, end);
+    if(sr_rt_parse_ip(&c, end, &entry->mask.s_addr) != 0)
+    { return -1; }
+    c = sr_rt_skip_blanks(c, end);
+
+    for(name = c; c < end && *c != ' ' && *c != '\t' && *c != '\r'; c++);
+    if(c == name || c - name >= sr_IFACE_NAMELEN)
+    { return -1; }
+    memcpy(entry->interface, name, c - name);
+
+    return sr_rt_skip_blanks(c, end) == end ? 1 : -1;
+} /* -- sr_rt_parse_line -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_parse_chunk(..)
+ * Scope: Local
+ *
+ * Thread body: parse every line of a chunk of the file into the chunk's
+ * own route array, noting (up to SR_RT_LOAD_BAD_MAX of) the malformed
+ * lines by their line number within the chunk.
+ *
+ *---------------------------------------------------------------------*/
+
+static void* sr_rt_parse_chunk(void* arg)
+{
+    struct sr_rt_chunk* chunk = (struct sr_rt_chunk*)arg;
+    struct sr_rt* routes = 0;
+    const char* line = chunk->start;
+    const char* eol = 0;
+    uint32_t cap;
+    int ret;
+
+    while(line < chunk->end)
+    {
+        eol = memchr(line, '\n', chunk->end - line);
+        if(eol == 0)
+        { eol = chunk->end; }
+        chunk->lines++;
+
+        if(chunk->nroutes == chunk->cap)
+        {
+            cap = chunk->cap ? chunk->cap * 2 : 1024;
+            routes = (struct sr_rt*)realloc(chunk->routes,
+                                            (size_t)cap * sizeof(struct sr_rt));
+            if(routes == 0)
+            {
+                chunk->nomem = 1;
+                return 0;
+            }
+            chunk->routes = routes;
+            chunk->cap = cap;
+        }
+
+        ret = sr_rt_parse_line(line, eol, &chunk->routes[chunk->nroutes]);
+        if(ret > 0)
+        { chunk->nroutes++; }
+        else if(ret < 0)
+        {
+            if(chunk->nbad < SR_RT_LOAD_BAD_MAX)
+            { chunk->bad[chunk->nbad] = chunk->lines; }
+            chunk->nbad++;
+        }
+
+        line = eol + 1;
+    }
+
+    return 0;
+} /* -- sr_rt_parse_chunk -- */
 
-    while( fgets(line,BUFSIZ,fp) != 0)
+/*---------------------------------------------------------------------
+ * Method: sr_rt_table_parse(..)
+ * Scope: Local
+ *
+ * Build a table from a text routing table.  The file is mapped and cut
+ * into one chunk per thread at line boundaries; the chunks are parsed in
+ * parallel and their routes then added to the FIB in file order, so the
+ * result is the same as a serial load.  Malformed lines are reported and
+ * skipped.  Returns 0 if the file can't be read or holds no routes.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_rt_table* sr_rt_table_parse(const char* filename, int engine)
+{
+    struct sr_rt_chunk chunk[SR_RT_LOAD_THREADS];
+    pthread_t thread[SR_RT_LOAD_THREADS];
+    int started[SR_RT_LOAD_THREADS];
+    struct sr_rt_table* table = 0;
+    struct stat st;
+    const char* text = 0;
+    const char* cut = 0;
+    uint32_t lines, nroutes, nbad, i, j;
+    long nthreads;
+    uint32_t digest[SR_RT_DIGEST];
+    int fd, error = 0;
+
+    if((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
+        perror("open");
+        if(fd >= 0)
+        { close(fd); }
+        return 0;
+    }
+    if(st.st_size == 0)
+    {
+        fprintf(stderr,"Error loading routing table, %s is empty\n", filename);
+        close(fd);
+        return 0;
+    }
+    text = (const char*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(text == MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+
+    /* -- small tables aren't worth starting threads for -- */
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > st.st_size / SR_RT_LOAD_CHUNK_MIN)
+    { nthreads = st.st_size / SR_RT_LOAD_CHUNK_MIN; }
+    if(nthreads > SR_RT_LOAD_THREADS)
+    { nthreads = SR_RT_LOAD_THREADS; }
+    if(nthreads < 1)
+    { nthreads = 1; }
+
+    memset(chunk, 0, sizeof(chunk));
+    cut = text;
+    for(i = 0; i < nthreads; i++)
+    {
+        chunk[i].start = cut;
+        cut = text + st.st_size * (i + 1) / nthreads;
+        if(i + 1 < nthreads && cut > chunk[i].start)
+        {
+            /* -- end the chunk on a line boundary -- */
+            cut = memchr(cut - 1, '\n', text + st.st_size - (cut - 1));
+            cut = cut ? cut + 1 : text + st.st_size;
         }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
+        if(cut < chunk[i].start)
+        { cut = chunk[i].start; }
+        chunk[i].end = cut;
+    }
+
+    /* -- the calling thread takes the first chunk -- */
+    for(i = 1; i < nthreads; i++)
+    {
+        started[i] = pthread_create(&thread[i], 0, sr_rt_parse_chunk,
+                                    &chunk[i]) == 0;
+    }
+    sr_rt_parse_chunk(&chunk[0]);
+
+    /* -- and digests the text while the others finish -- */
+    sr_rt_digest(text, st.st_size, digest);
+    for(i = 1; i < nthreads; i++)
+    {
+        if(started[i])
+        { pthread_join(thread[i], 0); }
+        else
+        { sr_rt_parse_chunk(&chunk[i]); }
+    }
+    munmap((void*)text, st.st_size);
+
+    /* -- report bad lines by their line number in the file -- */
+    lines = nroutes = nbad = 0;
+    for(i = 0; i < nthreads; i++)
+    {
+        if(chunk[i].nomem)
+        { error = 1; }
+        for(j = 0; j < chunk[i].nbad && j < SR_RT_LOAD_BAD_MAX; j++)
+        {
+            if(nbad + j < SR_RT_LOAD_BAD_MAX)
+            {
+                fprintf(stderr,"%s:%u: malformed route, skipped\n",
+                        filename, lines + chunk[i].bad[j]);
+            }
         }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
+        lines   += chunk[i].lines;
+        nroutes += chunk[i].nroutes;
+        nbad    += chunk[i].nbad;
+    }
+    if(nbad > SR_RT_LOAD_BAD_MAX)
+    {
+        fprintf(stderr,"%s: %u more malformed routes skipped\n",
+                filename, nbad - SR_RT_LOAD_BAD_MAX);
+    }
+
+    if(error)
+    { fprintf(stderr,"Error loading routing table, out of memory\n"); }
+    else if(nroutes == 0)
+    {
+        fprintf(stderr,"Error loading routing table, no routes in %s\n",
+                filename);
+    }
+    else if((table = sr_rt_table_create(engine)) == 0)
+    { fprintf(stderr,"Error loading routing table, out of memory\n"); }
+
+    for(i = 0; table && i < nthreads; i++)
+    {
+        for(j = 0; j < chunk[i].nroutes; j++)
+        {
+            if(sr_fib_insert(table->fib, &chunk[i].routes[j]) != 0)
+            {
+                fprintf(stderr,"Error adding route to forwarding table\n");
+                sr_rt_table_destroy(table);
+                table = 0;
+                break;
+            }
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+    }
+
+    for(i = 0; i < nthreads; i++)
+    { free(chunk[i].routes); }
+
+    if(table)
+    {
+        table->nbad = nbad;
+        memcpy(table->digest, digest, sizeof(digest));
+    }
+    return table;
+} /* -- sr_rt_table_parse -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_digest(..)
+ * Scope: Global
+ *
+ * SHA-1 of the len bytes at text, as SR_RT_DIGEST words in host order
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_digest(const char* text, size_t len, uint32_t* digest)
+{
+    SHA1Context sha1;
+    unsigned n;
+
+    SHA1Reset(&sha1);
+    while(len)
+    {
+        /* -- SHA1Input takes an unsigned length -- */
+        n = len > (1u << 30) ? (1u << 30) : (unsigned)len;
+        SHA1Input(&sha1, (const unsigned char*)text, n);
+        text += n;
+        len -= n;
+    }
+    SHA1Result(&sha1);
+
+    for(n = 0; n < SR_RT_DIGEST; n++)
+    { digest[n] = sha1.Message_Digest[n]; }
+} /* -- sr_rt_digest -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_file_digest(..)
+ * Scope: Global
+ *
+ * SHA-1 of what filename holds now (see sr_rt_digest).  Returns 0 on
+ * success, -1 if it can't be read.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_file_digest(const char* filename, uint32_t* digest)
+{
+    struct stat st;
+    const char* text = 0;
+    int fd;
+
+    if((fd = open(filename, O_RDONLY)) < 0)
+    { return -1; }
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if(st.st_size == 0)
+    {
+        close(fd);
+        sr_rt_digest("", 0, digest);
+        return 0;
+    }
+
+    text = (const char*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(text == MAP_FAILED)
+    { return -1; }
+
+    sr_rt_digest(text, st.st_size, digest);
+    munmap((void*)text, st.st_size);
+    return 0;
+} /* -- sr_rt_file_digest -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_table_load(..)
+ * Scope: Global
+ *
+ * Read a routing table file into a new, unpublished table and report
+ * how long it took.  Returns 0 if the file can't be read or holds no
+ * valid routes; malformed lines are skipped.  The file is either the
+ * usual text format or a binary image written by rtcompile, which is
+ * mapped as is and keeps the engine it was compiled for.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt_table* sr_rt_table_load(const char* filename, int engine)
+{
+    FILE* fp;
+    struct timeval start, end;
+    struct sr_rt_table* table = 0;
+    int image;
+    double secs;
+
+    /* -- REQUIRES -- */
+    assert(filename);
+    if( access(filename,R_OK) != 0)
+    {
+        perror("access");
+        return 0;
+    }
+
+    if((fp = fopen(filename,"r")) == 0)
+    {
+        perror("fopen");
+        return 0;
+    }
+    image = sr_fib_is_image(fp);
+    fclose(fp);
+
+    gettimeofday(&start, 0);
+    if(image)
+    {
+        if((table = (struct sr_rt_table*)calloc(1, sizeof(struct sr_rt_table)))
+                == 0)
+        { return 0; }
+        if((table->fib = sr_fib_map(filename)) == 0)
+        {
+            free(table);
+            return 0;
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
-    } /* -- while -- */
+    }
+    else if((table = sr_rt_table_parse(filename, engine)) == 0)
+    { return 0; }
+    gettimeofday(&end, 0);
+
+    table->fib->build_usec = (end.tv_sec - start.tv_sec) * 1000000L +
+                             (end.tv_usec - start.tv_usec);
+    secs = table->fib->build_usec / 1e6;
+    printf("Loaded %u routes from %s in %.3f s (%.0f routes/s)",
+           table->fib->nroutes, filename, secs,
+           secs > 0 ? table->fib->nroutes / secs : 0.0);
+    if(table->nbad)
+    { printf(", %u malformed lines skipped", table->nbad); }
+    printf("\n");
+
+    return table; /* -- success -- */
+} /* -- sr_rt_table_load -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_swap(..)
+ * Scope: Local
+ *
+ * Make table the current routing table and return the one it replaced.
+ * Caller holds sr->rt_lock.
+ *
+ *---------------------------------------------------------------------*/
+
+static struct sr_rt_table* sr_rt_swap(struct sr_instance* sr,
+                                      struct sr_rt_table* table)
+{
+    if(table->adj == 0)
+    {
+        table->adj = (struct sr_adj*)calloc(table->fib->nnhs + 1,
+                                            sizeof(struct sr_adj));
+        assert(table->adj);
+    }
+    table->gen = ++sr->rt_gen;
+    return __atomic_exchange_n(&sr->rt, table, __ATOMIC_ACQ_REL);
+} /* -- sr_rt_swap -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_publish(..)
+ * Scope: Global
+ *
+ * Atomically replace the current routing table with table, which must be
+ * fully built.  Forwarding carries on throughout: packets see either the
+ * old table or the new one, never a mix.  The old table is freed once no
+ * reader can still be using it, so this may block for as long as the
+ * longest read section; it must not be called from inside one.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_publish(struct sr_instance* sr, struct sr_rt_table* table)
+{
+    struct sr_rt_table* old = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(table);
+
+    pthread_mutex_lock(&sr->rt_lock);
+    old = sr_rt_swap(sr, table);
+    pthread_mutex_unlock(&sr->rt_lock);
+
+    if(old)
+    {
+        sr_epoch_synchronize(&sr->epoch);
+        sr_rt_table_destroy(old);
+    }
+} /* -- sr_rt_publish -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_current(..)
+ * Scope: Global
+ *
+ * The current routing table.  Only valid inside an epoch read section on
+ * sr->epoch.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt_table* sr_rt_current(struct sr_instance* sr)
+{
+    return __atomic_load_n(&sr->rt, __ATOMIC_ACQUIRE);
+} /* -- sr_rt_current -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_note_file(..)
+ * Scope: Local
+ *
+ * Remember that table, if it is still the current one, is what filename
+ * held, by the size and SHA-1 of the text it was parsed from; a warm
+ * start snapshot only reuses its FIB while the file still has both (see
+ * sr_snapshot.h).  Tables mapped from an image have no digest and are
+ * not saved, mapping them again is as quick.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_rt_note_file(struct sr_instance* sr, const char* filename,
+                            struct sr_rt_table* table)
+{
+    static const uint32_t none[SR_RT_DIGEST];
+    struct stat st;
+    int ok = stat(filename, &st) == 0 &&
+             memcmp(table->digest, none, sizeof(none)) != 0;
+
+    pthread_mutex_lock(&sr->rt_lock);
+    if(sr->rt == table)
+    {
+        sr->rt_file_gen = ok ? table->gen : 0;
+        sr->rt_size = ok ? st.st_size : 0;
+        memcpy(sr->rt_digest, table->digest, sizeof(sr->rt_digest));
+    }
+    pthread_mutex_unlock(&sr->rt_lock);
+} /* -- sr_rt_note_file -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt(..)
+ * Scope: Global
+ *
+ * Load a routing table file and make it the current table.  The file
+ * name is remembered for reloads (see sr_rt_reload_thread).
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr,const char* filename)
+{
+    struct sr_rt_table* table = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(filename);
+
+    if((table = sr_rt_table_load(filename, sr->fib_engine)) == 0)
+    { return -1; }
+
+    printf("Loading routing table from server, clear local routing table.\n");
+    strncpy(sr->rtable, filename, sizeof(sr->rtable) - 1);
+    sr_rt_publish(sr, table);
+    sr_rt_note_file(sr, filename, table);
 
     return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_add_rt_entry(..)
+ * Scope: Global
+ *
+ * Add a single route.  The current table is copied with the route
+ * appended and the copy published, so every call is O(routes) and adding
+ * n routes one at a time O(n^2); to add many, build a table with
+ * sr_rt_table_create() and sr_rt_table_add() and publish it once with
+ * sr_rt_publish().  A table mapped from an image is copied into memory.
+ *
+ * Returns 0 on success, -1 if the copy couldn't be built, in which case
+ * the current table stays.
  *
  *---------------------------------------------------------------------*/
 
-void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
+int sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
 struct in_addr gw, struct in_addr mask,char* if_name)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_rt_table* table = 0;
+    struct sr_rt_table* old = 0;
+    struct sr_rt entry;
+    uint32_t i;
+    int error = 0;
 
     /* -- REQUIRES -- */
     assert(if_name);
     assert(sr);
 
-    /* -- empty list special case -- */
-    if(sr->routing_table == 0)
+    pthread_mutex_lock(&sr->rt_lock);
+
+    table = sr_rt_table_create(sr->rt ? sr->rt->fib->engine : sr->fib_engine);
+    if(table == 0)
     {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
-        sr->routing_table->next = 0;
-        sr->routing_table->dest = dest;
-        sr->routing_table->gw   = gw;
-        sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        pthread_mutex_unlock(&sr->rt_lock);
+        fprintf(stderr,"Error: out of memory (sr_add_rt_entry)\n");
+        return -1;
+    }
+    for(i = 0; !error && sr->rt && i < sr->rt->fib->nroutes; i++)
+    {
+        sr_fib_route_get(sr->rt->fib, i, &entry);
+        error = sr_rt_table_add(table, entry.dest, entry.gw, entry.mask,
+                                entry.interface);
+    }
+    if(!error)
+    { error = sr_rt_table_add(table, dest, gw, mask, if_name); }
 
-        return;
+    /* -- a table missing a route is never published -- */
+    if(error)
+    {
+        pthread_mutex_unlock(&sr->rt_lock);
+        sr_rt_table_destroy(table);
+        return -1;
     }
 
-    /* -- find the end of the list -- */
-    rt_walker = sr->routing_table;
-    while(rt_walker->next){
-      rt_walker = rt_walker->next; 
+    old = sr_rt_swap(sr, table);
+    pthread_mutex_unlock(&sr->rt_lock);
+
+    if(old)
+    {
+        sr_epoch_synchronize(&sr->epoch);
+        sr_rt_table_destroy(old);
     }
+    return 0;
+} /* -- sr_add_entry -- */
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
-    rt_walker = rt_walker->next;
+/*---------------------------------------------------------------------
+ * Method: sr_rt_reload_thread(..)
+ * Scope: Global
+ *
+ * Reload the routing table file on SIGHUP.  The new table is built off
+ * to the side and published in one step, so forwarding never stalls or
+ * sees a half loaded table; if the file is bad the current table stays.
+ * SIGHUP must be blocked in every other thread.
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_rt_reload_thread(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    struct sr_rt_table* table = 0;
+    sigset_t set;
+    int sig;
 
-    rt_walker->next = 0;
-    rt_walker->dest = dest;
-    rt_walker->gw   = gw;
-    rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
 
-} /* -- sr_add_entry -- */
+    while(1)
+    {
+        if(sigwait(&set, &sig) != 0)
+        { continue; }
+
+        if(sr->rtable[0] == 0)
+        {
+            fprintf(stderr,"SIGHUP: no routing table file to reload\n");
+            continue;
+        }
+
+        printf("SIGHUP: reloading routing table from %s\n", sr->rtable);
+        if((table = sr_rt_table_load(sr->rtable, sr->fib_engine)) == 0)
+        {
+            fprintf(stderr,"Reload failed, keeping current routing table\n");
+            continue;
+        }
+        sr_fib_report(table->fib);
+        sr_rt_publish(sr, table);
+        sr_rt_note_file(sr, sr->rtable, table);
+    }
+
+    return 0;
+} /* -- sr_rt_reload_thread -- */
 
 /*---------------------------------------------------------------------
  * Method:
@@ -138,25 +804,31 @@ struct in_addr gw, struct in_addr mask,char* if_name)
 
 void sr_print_routing_table(struct sr_instance* sr)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_rt_table* table = 0;
+    struct sr_rt entry;
+    uint32_t i;
 
-    if(sr->routing_table == 0)
+    sr_epoch_enter(&sr->epoch);
+    table = sr_rt_current(sr);
+
+    if(table == 0 || table->fib->nroutes == 0)
     {
         printf(" *warning* Routing table empty \n");
+        sr_epoch_exit(&sr->epoch);
         return;
     }
 
     printf("Destination\tGateway\t\tMask\tIface\n");
 
-    rt_walker = sr->routing_table;
-    
-    sr_print_routing_entry(rt_walker);
-    while(rt_walker->next)
+    for(i = 0; i < table->fib->nroutes && i < SR_RT_PRINT_MAX; i++)
     {
-        rt_walker = rt_walker->next; 
-        sr_print_routing_entry(rt_walker);
+        sr_fib_route_get(table->fib, i, &entry);
+        sr_print_routing_entry(&entry);
     }
+    if(i < table->fib->nroutes)
+    { printf("... and %u more routes\n", table->fib->nroutes - i); }
 
+    sr_epoch_exit(&sr->epoch);
 } /* -- sr_print_routing_table -- */
 
 /*---------------------------------------------------------------------
@@ -176,3 +848,65 @@ void sr_print_routing_entry(struct sr_rt* entry)
     printf("%s\n",entry->interface);
 
 } /* -- sr_print_routing_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup(..)
+ * Scope: Global
+ *
+ * Longest prefix match of a destination (network byte order) against the
+ * routing table.  Returns the next hop of the route, 0 if no route
+ * matches.  Call inside an epoch read section; the next hop is only valid
+ * until it ends.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib_nh* sr_fib_lookup(struct sr_instance* sr, uint32_t ip_nbo)
+{
+    struct sr_rt_table* table = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    table = sr_rt_current(sr);
+    return table ? sr_fib_find(table->fib, ip_nbo) : 0;
+} /* -- sr_fib_lookup -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup_bulk(..)
+ * Scope: Global
+ *
+ * sr_fib_lookup() for a burst of n destinations (network byte order),
+ * out[i] receiving the next hop for dst[i] or 0.  Cheaper per packet than
+ * n separate lookups since the table accesses of the burst overlap.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_lookup_bulk(struct sr_instance* sr, const uint32_t* dst, int n,
+                        struct sr_fib_nh** out)
+{
+    struct sr_rt_table* table = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    table = sr_rt_current(sr);
+    sr_fib_find_bulk(table ? table->fib : 0, dst, n, out);
+} /* -- sr_fib_lookup_bulk -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_adj(..)
+ * Scope: Global
+ *
+ * The adjacency of a next hop returned by a lookup in a published table
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_adj* sr_rt_adj(struct sr_rt_table* table, struct sr_fib_nh* nh)
+{
+    /* -- REQUIRES -- */
+    assert(table);
+    assert(table->adj);
+    assert(nh);
+
+    return &table->adj[nh - table->fib->nhs];
+} /* -- sr_rt_adj -- */
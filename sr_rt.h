@@ -19,6 +19,10 @@
 #include <netinet/in.h>
 
 #include "sr_if.h"
+#include "sr_protocol.h"
+
+struct sr_fib;
+struct sr_fib_nh;
 
 /* ----------------------------------------------------------------------------
  * struct sr_rt
@@ -36,12 +40,76 @@ struct sr_rt
     struct sr_rt* next;
 };
 
+#define SR_RT_DIGEST 5 /* words of a SHA-1 digest */
+
+/* ----------------------------------------------------------------------------
+ * struct sr_adj
+ *
+ * Adjacency: what the forwarding path needs to send to one next hop of
+ * the FIB (struct sr_fib_nh), shared by every route through it.  Filled
+ * in by the forwarding thread the first time the next hop is used; the
+ * Ethernet header is rebuilt when the ARP cache changes (arp_gen, see
+ * sr_flowcache.h).  Directly connected next hops only cache the
+ * interface, their MAC depends on the destination.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_adj
+{
+    int               bound;    /* ifid looked up, on first use */
+    int               ifid;     /* egress interface's number, or
+                                   SR_IF_NONE if there is no such one */
+    int               resolved; /* eth holds the gateway's MAC */
+    uint32_t          arp_gen;  /* ARP cache generation eth was built in */
+    uint32_t          arp_round;/* ARP round the gateway was last looked
+                                   up in, see sr_arpcache_round */
+    sr_ethernet_hdr_t eth;      /* rewrite template, copied over the
+                                   incoming header as is */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_rt_table
+ *
+ * One version of the routing table: the FIB compiled from the routes, which
+ * also keeps the routes themselves in the order they were added
+ * (fib->routes[0 .. fib->nroutes)).  The FIB is either built in memory or
+ * mapped from a binary image (see sr_fib_map).  The current version is
+ * published in sr->rt and is never modified; changes build a new version
+ * and swap it in whole with sr_rt_publish.  Readers must be inside an
+ * epoch read section on sr->epoch to use it.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_rt_table
+{
+    struct sr_fib* fib;
+    struct sr_adj* adj;  /* one per fib->nhs, allocated when published */
+    uint32_t       gen;  /* set when published, see sr_flowcache.h */
+    uint32_t       nbad; /* malformed lines skipped when loaded */
+    uint32_t       digest[SR_RT_DIGEST]; /* SHA-1 of the text it was parsed
+                                            from, all 0 if it wasn't */
+};
+
+struct sr_rt_table* sr_rt_table_create(int engine);
+void sr_rt_table_destroy(struct sr_rt_table*);
+int sr_rt_table_add(struct sr_rt_table*, struct in_addr, struct in_addr,
+                    struct in_addr, const char*);
+struct sr_rt_table* sr_rt_table_load(const char*, int engine);
+void sr_rt_digest(const char* text, size_t len, uint32_t* digest);
+int sr_rt_file_digest(const char* filename, uint32_t* digest);
+void sr_rt_publish(struct sr_instance*, struct sr_rt_table*);
+struct sr_rt_table* sr_rt_current(struct sr_instance*);
+void* sr_rt_reload_thread(void*);
 
 int sr_load_rt(struct sr_instance*,const char*);
-void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
+int sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
+struct sr_fib_nh* sr_fib_lookup(struct sr_instance*, uint32_t ip_nbo);
+void sr_fib_lookup_bulk(struct sr_instance*, const uint32_t* dst, int n,
+                        struct sr_fib_nh** out);
+struct sr_adj* sr_rt_adj(struct sr_rt_table*, struct sr_fib_nh*);
 
 
 #endif  /* --  sr_RT_H -- */
@@ -0,0 +1,377 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_snapshot.c
+ *
+ * Description:
+ *
+ * Warm start snapshot of the ARP cache and the FIB (see sr_snapshot.h)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sr_snapshot.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_if.h"
+
+/* Serialises the periodic save against the one at shutdown */
+static pthread_mutex_t sr_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_path(..)
+ * Scope: Local
+ *
+ * The snapshot's name plus suffix, malloc'ed.
+ *
+ *---------------------------------------------------------------------*/
+
+static char* sr_snapshot_path(struct sr_instance* sr, const char* suffix)
+{
+    char* path = 0;
+
+    if((path = (char*)malloc(strlen(sr->snapshot) + strlen(suffix) + 1)) != 0)
+    { sprintf(path, "%s%s", sr->snapshot, suffix); }
+
+    return path;
+} /* -- sr_snapshot_path -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_map(..)
+ * Scope: Local
+ *
+ * Map the manifest read only and check that it was written by this
+ * build: magic, version, byte order, record size, and that the records
+ * fit the file.  Returns 0 if there is none or it doesn't check out.
+ *
+ *---------------------------------------------------------------------*/
+
+static const struct sr_snapshot_hdr* sr_snapshot_map(struct sr_instance* sr,
+                                                     size_t* len)
+{
+    const struct sr_snapshot_hdr* hdr = 0;
+    struct stat st;
+    void* map;
+    int fd;
+
+    if((fd = open(sr->snapshot, O_RDONLY)) < 0)
+    { return 0; }
+
+    if(fstat(fd, &st) != 0 ||
+       (size_t)st.st_size < sizeof(struct sr_snapshot_hdr))
+    {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    { return 0; }
+
+    hdr = (const struct sr_snapshot_hdr*)map;
+    if(memcmp(hdr->magic, SR_SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+       hdr->version != SR_SNAPSHOT_VERSION ||
+       hdr->byte_order != SR_SNAPSHOT_ORDER ||
+       hdr->entry_size != sizeof(struct sr_arpsnap) ||
+       (uint64_t)hdr->nentries * sizeof(struct sr_arpsnap) >
+            (uint64_t)st.st_size - sizeof(struct sr_snapshot_hdr))
+    {
+        fprintf(stderr,"Ignoring snapshot %s, not written by this router\n",
+                sr->snapshot);
+        munmap(map, (size_t)st.st_size);
+        return 0;
+    }
+
+    *len = (size_t)st.st_size;
+    return hdr;
+} /* -- sr_snapshot_map -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_load_rt(..)
+ * Scope: Global
+ *
+ * Make the snapshot's FIB image the current routing table if it was
+ * compiled from rtable as it is now, with the same engine.  rtable is
+ * still what SIGHUP reloads.  Returns 0 on success, -1 if rtable must be
+ * loaded instead.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_snapshot_load_rt(struct sr_instance* sr, const char* rtable)
+{
+    const struct sr_snapshot_hdr* hdr = 0;
+    struct sr_rt_table* table = 0;
+    struct stat st;
+    uint32_t digest[SR_RT_DIGEST];
+    char* fib = 0;
+    size_t len = 0;
+    int ok;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(rtable);
+
+    if(sr->snapshot[0] == 0 || (hdr = sr_snapshot_map(sr, &len)) == 0)
+    { return -1; }
+
+    /* -- the size rules most changes out before reading the whole file;
+     *    an mtime could miss a rewrite within the same second -- */
+    ok = hdr->fib_valid && hdr->fib_engine == (uint32_t)sr->fib_engine &&
+         strncmp(hdr->rtable, rtable, sizeof(hdr->rtable)) == 0 &&
+         stat(rtable, &st) == 0 && (int64_t)st.st_size == hdr->rt_size &&
+         sr_rt_file_digest(rtable, digest) == 0 &&
+         memcmp(digest, hdr->rt_digest, sizeof(digest)) == 0;
+    munmap((void*)hdr, len);
+
+    if(!ok || (fib = sr_snapshot_path(sr, ".fib")) == 0)
+    { return -1; }
+
+    table = sr_rt_table_load(fib, sr->fib_engine);
+    if(table && table->fib->engine != sr->fib_engine)
+    {
+        sr_rt_table_destroy(table);
+        table = 0;
+    }
+    if(table == 0)
+    {
+        fprintf(stderr,"Snapshot %s unusable, loading %s\n", fib, rtable);
+        free(fib);
+        return -1;
+    }
+
+    printf("Warm start: routing table %s from snapshot %s\n", rtable, fib);
+    free(fib);
+
+    strncpy(sr->rtable, rtable, sizeof(sr->rtable) - 1);
+    sr_rt_publish(sr, table);
+
+    /* -- it is rtable's table, and already saved -- */
+    pthread_mutex_lock(&sr->rt_lock);
+    if(sr->rt == table)
+    {
+        sr->rt_file_gen = table->gen;
+        sr->rt_size = st.st_size;
+        memcpy(sr->rt_digest, digest, sizeof(sr->rt_digest));
+        sr->snap_gen = table->gen;
+    }
+    pthread_mutex_unlock(&sr->rt_lock);
+
+    return 0; /* -- success -- */
+} /* -- sr_snapshot_load_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_restore_arp(..)
+ * Scope: Global
+ *
+ * Install the snapshot's ARP mappings that are young enough and whose
+ * interface still exists, each verified in the background.  Call once
+ * the interfaces are known and the ARP cache is running.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_snapshot_restore_arp(struct sr_instance* sr)
+{
+    const struct sr_snapshot_hdr* hdr = 0;
+    const struct sr_arpsnap* snaps = 0;
+    struct sr_arpsnap snap;
+    uint64_t life, verify;
+    time_t now = time(NULL);
+    uint32_t elapsed, i, n = 0, stale = 0;
+    int ifid;
+    size_t len = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    if(sr->snapshot[0] == 0 || (hdr = sr_snapshot_map(sr, &len)) == 0)
+    { return; }
+
+    elapsed = now > (time_t)hdr->saved ? (uint32_t)(now - hdr->saved) : 0;
+    snaps = (const struct sr_arpsnap*)(hdr + 1);
+
+    for(i = 0; i < hdr->nentries; i++)
+    {
+        memcpy(&snap, &snaps[i], sizeof(struct sr_arpsnap));
+        snap.iface[sr_IFACE_NAMELEN - 1] = 0;
+        snap.age += elapsed;
+
+        /* -- what would be left of its lifetime before the refresh -- */
+        life = (uint64_t)snap.age * 1000 + SR_ARPCACHE_REFRESH_MS;
+        ifid = sr_interface_id(sr, snap.iface);
+        if(life >= (uint64_t)SR_ARPCACHE_TO * 1000 || ifid == SR_IF_NONE)
+        {
+            stale++;
+            continue;
+        }
+        life = (uint64_t)SR_ARPCACHE_TO * 1000 - life;
+
+        /* -- spread out so the interfaces' rate limits let them all go -- */
+        verify = SR_SNAPSHOT_VERIFY_MS + (uint64_t)n * SR_SNAPSHOT_VERIFY_GAP_MS;
+        sr_arpcache_restore(&(sr->cache), &snap, ifid,
+                            (uint32_t)(verify < life ? verify : life));
+        n++;
+    }
+
+    printf("Warm start: %u ARP mappings from snapshot %s, %u stale\n",
+           n, sr->snapshot, stale);
+    munmap((void*)hdr, len);
+} /* -- sr_snapshot_restore_arp -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_save(..)
+ * Scope: Global
+ *
+ * Write the snapshot: the FIB image if the current table is the one
+ * loaded from sr->rtable and hasn't been saved yet, then the manifest
+ * with the ARP mappings.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_snapshot_save(struct sr_instance* sr)
+{
+    struct sr_snapshot_hdr hdr;
+    struct sr_rt_table* table = 0;
+    struct sr_arpsnap* snaps = 0;
+    uint32_t file_gen, max;
+    size_t len;
+    char* fib = 0;
+    char* tmp = 0;
+    FILE* fp = 0;
+    int ret = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    if(sr->snapshot[0] == 0)
+    { return -1; }
+
+    pthread_mutex_lock(&sr_snapshot_lock);
+
+    memset(&hdr, 0, sizeof(struct sr_snapshot_hdr));
+    memcpy(hdr.magic, SR_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version    = SR_SNAPSHOT_VERSION;
+    hdr.byte_order = SR_SNAPSHOT_ORDER;
+    hdr.entry_size = sizeof(struct sr_arpsnap);
+    hdr.fib_engine = sr->fib_engine;
+
+    /* -- the FIB, unless routes were added by hand since the load -- */
+    sr_epoch_enter(&sr->epoch);
+    table = sr_rt_current(sr);
+
+    pthread_mutex_lock(&sr->rt_lock);
+    file_gen = sr->rt_file_gen;
+    hdr.rt_size = sr->rt_size;
+    memcpy(hdr.rt_digest, sr->rt_digest, sizeof(hdr.rt_digest));
+    len = strlen(sr->rtable);
+    if(len >= sizeof(hdr.rtable))
+    { len = sizeof(hdr.rtable) - 1; }
+    memcpy(hdr.rtable, sr->rtable, len);
+    hdr.rtable[len] = 0;
+    pthread_mutex_unlock(&sr->rt_lock);
+
+    if(table && file_gen != 0 && table->gen == file_gen &&
+       (fib = sr_snapshot_path(sr, ".fib")) != 0)
+    {
+        if(table->gen == sr->snap_gen || sr_fib_save(table->fib, fib) == 0)
+        {
+            sr->snap_gen = table->gen;
+            hdr.fib_valid = 1;
+            hdr.fib_engine = table->fib->engine;
+        }
+        free(fib);
+    }
+    sr_epoch_exit(&sr->epoch);
+
+    /* -- the ARP mappings -- */
+    pthread_mutex_lock(&(sr->cache.lock));
+    max = sr->cache.count;
+    pthread_mutex_unlock(&(sr->cache.lock));
+
+    if(max && (snaps = (struct sr_arpsnap*)malloc(max *
+                        sizeof(struct sr_arpsnap))) != 0)
+    { hdr.nentries = sr_arpcache_export(sr, snaps, max); }
+    hdr.saved = time(NULL);
+
+    if((tmp = sr_snapshot_path(sr, ".tmp")) == 0 ||
+       (fp = fopen(tmp, "w")) == 0)
+    {
+        perror("Error writing snapshot");
+        free(tmp);
+        free(snaps);
+        pthread_mutex_unlock(&sr_snapshot_lock);
+        return -1;
+    }
+
+    if(fwrite(&hdr, sizeof(struct sr_snapshot_hdr), 1, fp) != 1 ||
+       fwrite(snaps, sizeof(struct sr_arpsnap), hdr.nentries, fp) !=
+            hdr.nentries)
+    { ret = -1; }
+    if(fclose(fp) != 0)
+    { ret = -1; }
+
+    if(ret == 0 && rename(tmp, sr->snapshot) != 0)
+    { ret = -1; }
+    if(ret != 0)
+    {
+        perror("Error writing snapshot");
+        unlink(tmp);
+    }
+
+    free(tmp);
+    free(snaps);
+    pthread_mutex_unlock(&sr_snapshot_lock);
+    return ret;
+} /* -- sr_snapshot_save -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_snapshot_thread(..)
+ * Scope: Global
+ *
+ * Save the snapshot every SR_SNAPSHOT_SECS, and once more on SIGINT or
+ * SIGTERM before exiting.  Both signals must be blocked in every thread
+ * (see sr_init).
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_snapshot_thread(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    struct timespec ts;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    while(1)
+    {
+        ts.tv_sec = SR_SNAPSHOT_SECS;
+        ts.tv_nsec = 0;
+        if((sig = sigtimedwait(&set, 0, &ts)) < 0 && errno != EAGAIN)
+        { continue; }
+
+        sr_snapshot_save(sr);
+
+        if(sig == SIGINT || sig == SIGTERM)
+        {
+            printf("Saved snapshot %s, exiting\n", sr->snapshot);
+            exit(0);
+        }
+    }
+
+    return 0;
+} /* -- sr_snapshot_thread -- */
@@ -0,0 +1,80 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_snapshot.h
+ *
+ * Description:
+ *
+ * Warm start snapshot of the router's learned state, so that a restart
+ * forwards at full speed from the first packet instead of re-parsing the
+ * routing table and re-resolving every neighbor.
+ *
+ * A snapshot named path is two files:
+ *
+ *  path      - a manifest: the header below followed by the ARP mappings
+ *              as an array of struct sr_arpsnap (see sr_arpcache.h)
+ *  path.fib  - the compiled FIB as a binary image (see sr_fib_save)
+ *
+ * Both are rewritten every SR_SNAPSHOT_SECS, when the router is told to
+ * stop (SIGINT, SIGTERM) and when the server closes the session; each is
+ * written to a temporary file and renamed over the old one.  The FIB is
+ * only rewritten when the routing table changed since it was last saved.
+ *
+ * On startup the FIB image is mapped in place of loading the routing
+ * table file as long as that file still has the size and SHA-1 the
+ * manifest recorded and the FIB engine is the same; otherwise the file is
+ * loaded as usual.  The ARP mappings younger than SR_ARPCACHE_TO are
+ * installed and used straight away, and verified in the background: each
+ * gets a unicast request, spread SR_SNAPSHOT_VERIFY_GAP_MS apart, and is
+ * dropped unless it is answered (see sr_arpcache_restore).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_SNAPSHOT_H
+#define sr_SNAPSHOT_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif
+
+#define SR_SNAPSHOT_MAGIC   "SRSNAPSH"
+#define SR_SNAPSHOT_VERSION 2
+#define SR_SNAPSHOT_ORDER   0x01020304
+
+#define SR_SNAPSHOT_SECS          60   /* Between periodic saves */
+#define SR_SNAPSHOT_VERIFY_MS     1000 /* Before the first verification */
+#define SR_SNAPSHOT_VERIFY_GAP_MS (1000 / SR_ARP_RATE)
+
+struct sr_instance;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_snapshot_hdr
+ *
+ * Start of the manifest.  nentries struct sr_arpsnap follow it.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_snapshot_hdr
+{
+    char     magic[8];     /* SR_SNAPSHOT_MAGIC, not NUL terminated */
+    uint32_t version;      /* SR_SNAPSHOT_VERSION */
+    uint32_t byte_order;   /* SR_SNAPSHOT_ORDER as written */
+    uint32_t entry_size;   /* sizeof(struct sr_arpsnap) */
+    uint32_t nentries;
+    int64_t  saved;        /* time(2) when written */
+    uint32_t fib_valid;    /* path.fib was compiled from the rtable below */
+    uint32_t fib_engine;
+    int64_t  rt_size;
+    uint32_t rt_digest[5]; /* SHA-1 of the rtable, see sr_rt_digest */
+    uint32_t pad;
+    char     rtable[256];
+};
+
+int  sr_snapshot_load_rt(struct sr_instance*, const char* rtable);
+void sr_snapshot_restore_arp(struct sr_instance*);
+int  sr_snapshot_save(struct sr_instance*);
+void* sr_snapshot_thread(void*);
+
+#endif /* --  sr_SNAPSHOT_H -- */
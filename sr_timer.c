@@ -0,0 +1,293 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.c
+ *
+ * Description:
+ *
+ * Hierarchical timing wheel (see sr_timer.h)
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include "sr_timer.h"
+
+#define SR_TIMER_MASK (SR_TIMER_SLOTS - 1)
+#define SR_TIMER_SPAN ((uint64_t)1 << (SR_TIMER_BITS * SR_TIMER_LEVELS))
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_place(..)
+ * Scope: Local
+ *
+ * Links t into the slot for its expiry: level 0 holds the next 256 ms
+ * one per slot, each level above holds 256 times the span of the one
+ * below.  Does not count t.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_timer_place(struct sr_timer_wheel* w, struct sr_timer* t)
+{
+    uint64_t delta;
+    struct sr_timer** slot;
+    int level = 0;
+
+    if(t->expires < w->now)
+    { t->expires = w->now; }
+    delta = t->expires - w->now;
+    if(delta >= SR_TIMER_SPAN)
+    {
+        t->expires = w->now + SR_TIMER_SPAN - 1;
+        delta = SR_TIMER_SPAN - 1;
+    }
+
+    while(delta >= ((uint64_t)1 << (SR_TIMER_BITS * (level + 1))))
+    { level++; }
+
+    slot = &(w->slots[level][(t->expires >> (SR_TIMER_BITS * level)) &
+                             SR_TIMER_MASK]);
+    t->next = *slot;
+    if(t->next)
+    { t->next->pprev = &(t->next); }
+    t->pprev = slot;
+    *slot = t;
+} /* -- sr_timer_place -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_unlink(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_timer_unlink(struct sr_timer* t)
+{
+    *(t->pprev) = t->next;
+    if(t->next)
+    { t->next->pprev = t->pprev; }
+    t->next = 0;
+    t->pprev = 0;
+} /* -- sr_timer_unlink -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_cascade(..)
+ * Scope: Local
+ *
+ * Refiles every timer in one slot of an upper level; they all expire
+ * within the span of the levels below it now
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_timer_cascade(struct sr_timer_wheel* w, int level, int index)
+{
+    struct sr_timer* t = w->slots[level][index];
+    struct sr_timer* next;
+
+    w->slots[level][index] = 0;
+    for(; t; t = next)
+    {
+        next = t->next;
+        sr_timer_place(w, t);
+    }
+} /* -- sr_timer_cascade -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_now_ms(..)
+ * Scope: Global
+ *
+ * Monotonic clock in milliseconds, the time base of every wheel
+ *
+ *---------------------------------------------------------------------*/
+
+uint64_t sr_timer_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+} /* -- sr_timer_now_ms -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_wheel_init(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_wheel_init(struct sr_timer_wheel* w, uint64_t now)
+{
+    assert(w);
+
+    memset(w, 0, sizeof(struct sr_timer_wheel));
+    w->now = now;
+} /* -- sr_timer_wheel_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_init(..)
+ * Scope: Global
+ *
+ * Sets up t to call fn(t, arg) when it expires; t isn't scheduled
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_init(struct sr_timer* t, sr_timer_fn fn, void* arg)
+{
+    assert(t);
+    assert(fn);
+
+    t->next = 0;
+    t->pprev = 0;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+} /* -- sr_timer_init -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_add(..)
+ * Scope: Global
+ *
+ * (Re)schedules t to run once the wheel reaches expires.  A time
+ * already passed runs on the next advance.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_add(struct sr_timer_wheel* w, struct sr_timer* t,
+                  uint64_t expires)
+{
+    assert(w);
+    assert(t);
+
+    if(t->pprev)
+    { sr_timer_unlink(t); }
+    else
+    { w->count++; }
+
+    t->expires = expires;
+    sr_timer_place(w, t);
+} /* -- sr_timer_add -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_del(..)
+ * Scope: Global
+ *
+ * Cancels t; does nothing if it isn't scheduled
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_del(struct sr_timer_wheel* w, struct sr_timer* t)
+{
+    assert(w);
+    assert(t);
+
+    if(t->pprev)
+    {
+        sr_timer_unlink(t);
+        w->count--;
+    }
+} /* -- sr_timer_del -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_pending(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_timer_pending(const struct sr_timer* t)
+{
+    return t->pprev != 0;
+} /* -- sr_timer_pending -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_advance(..)
+ * Scope: Global
+ *
+ * Runs every timer that expires up to and including now, in order of
+ * expiry.  Each is unscheduled before its callback runs, so the
+ * callback may free it, reschedule it, or add and cancel others.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_advance(struct sr_timer_wheel* w, uint64_t now)
+{
+    struct sr_timer* list;
+    struct sr_timer* t;
+    int index, level;
+
+    assert(w);
+
+    while(w->now <= now)
+    {
+        /* -- nothing left to run, catch straight up -- */
+        if(w->count == 0)
+        {
+            w->now = now + 1;
+            break;
+        }
+
+        /* -- move the slot onto a local list that callbacks can edit -- */
+        index = w->now & SR_TIMER_MASK;
+        list = w->slots[0][index];
+        w->slots[0][index] = 0;
+        if(list)
+        { list->pprev = &list; }
+        w->now++;
+
+        /* -- level 0 wrapped, bring the next span down from above -- */
+        index = w->now & SR_TIMER_MASK;
+        for(level = 1; index == 0 && level < SR_TIMER_LEVELS; level++)
+        {
+            index = (w->now >> (SR_TIMER_BITS * level)) & SR_TIMER_MASK;
+            sr_timer_cascade(w, level, index);
+        }
+
+        while((t = list) != 0)
+        {
+            sr_timer_unlink(t);
+            w->count--;
+            t->fn(t, t->arg);
+        }
+    }
+} /* -- sr_timer_advance -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_next(..)
+ * Scope: Global
+ *
+ * When sr_timer_advance() next has something to do: the first expiry
+ * in level 0 or the first time a higher level is cascaded, whichever
+ * comes sooner.  SR_TIMER_NEVER if nothing is scheduled.
+ *
+ *---------------------------------------------------------------------*/
+
+uint64_t sr_timer_next(const struct sr_timer_wheel* w)
+{
+    uint64_t next = SR_TIMER_NEVER;
+    uint64_t base, when;
+    int level, shift, index, j;
+
+    assert(w);
+
+    if(w->count == 0)
+    { return SR_TIMER_NEVER; }
+
+    for(level = 0; level < SR_TIMER_LEVELS; level++)
+    {
+        shift = SR_TIMER_BITS * level;
+        base = w->now >> shift;
+        index = base & SR_TIMER_MASK;
+
+        /* -- above level 0 the current slot comes round last -- */
+        for(j = (level == 0) ? 0 : 1; j <= SR_TIMER_SLOTS; j++)
+        {
+            if(w->slots[level][(index + j) & SR_TIMER_MASK])
+            {
+                when = (level == 0) ? w->now + j : (base + j) << shift;
+                if(when < next)
+                { next = when; }
+                break;
+            }
+        }
+    }
+
+    return next;
+} /* -- sr_timer_next -- */
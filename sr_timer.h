@@ -0,0 +1,73 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.h
+ *
+ * Description:
+ *
+ * Hierarchical timing wheel for per-object timeouts with millisecond
+ * resolution.  Timers are embedded in the objects they time out, so
+ * scheduling and cancelling allocate nothing and are O(1).  Four levels of
+ * 256 slots cover 2^32 ms (about 49 days) ahead: a timer is filed in the
+ * lowest level whose span reaches its expiry, and is moved down a level
+ * each time the wheel below it wraps.  Advancing the wheel only visits the
+ * slots for the milliseconds that passed and only runs the timers in them.
+ *
+ * Times are absolute, in the milliseconds of sr_timer_now_ms().  The wheel
+ * has no lock of its own; every call on one wheel, and every callback it
+ * runs, must be serialised by its owner.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef sr_TIMER_H
+#define sr_TIMER_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif
+
+#define SR_TIMER_LEVELS 4
+#define SR_TIMER_BITS   8
+#define SR_TIMER_SLOTS  (1 << SR_TIMER_BITS)
+#define SR_TIMER_NEVER  ((uint64_t)-1)
+
+struct sr_timer;
+
+typedef void (*sr_timer_fn)(struct sr_timer* timer, void* arg);
+
+/* ----------------------------------------------------------------------------
+ * struct sr_timer
+ *
+ * One pending timeout, embedded in the object it belongs to
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_timer
+{
+    struct sr_timer*  next;
+    struct sr_timer** pprev;   /* 0 while not scheduled */
+    uint64_t expires;          /* ms, see sr_timer_now_ms() */
+    sr_timer_fn fn;
+    void* arg;
+};
+
+struct sr_timer_wheel
+{
+    uint64_t now;              /* next ms to be run */
+    uint32_t count;            /* timers scheduled */
+    struct sr_timer* slots[SR_TIMER_LEVELS][SR_TIMER_SLOTS];
+};
+
+uint64_t sr_timer_now_ms(void);
+void sr_timer_wheel_init(struct sr_timer_wheel* w, uint64_t now);
+void sr_timer_init(struct sr_timer* t, sr_timer_fn fn, void* arg);
+void sr_timer_add(struct sr_timer_wheel* w, struct sr_timer* t,
+                  uint64_t expires);
+void sr_timer_del(struct sr_timer_wheel* w, struct sr_timer* t);
+int  sr_timer_pending(const struct sr_timer* t);
+void sr_timer_advance(struct sr_timer_wheel* w, uint64_t now);
+uint64_t sr_timer_next(const struct sr_timer_wheel* w);
+
+#endif /* --  sr_TIMER_H -- */
@@ -19,6 +19,24 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/* Checksum sum after one 16 bit word covered by it changes from old to
+   new, all in network byte order (RFC 1624, eqn. 3).  Gives what cksum()
+   would over the new data, and a wrong checksum stays wrong. */
+uint16_t cksum_update(uint16_t sum, uint16_t old, uint16_t new) {
+  uint32_t s = (uint16_t)~sum + (uint16_t)~old + new;
+
+  s = (s >> 16) + (s & 0xffff);
+  s = (s >> 16) + (s & 0xffff);
+  s = ~s & 0xffff;
+  return s ? s : 0xffff;
+}
+
+/* Same for a 32 bit field, e.g. an address */
+uint16_t cksum_update32(uint16_t sum, uint32_t old, uint32_t new) {
+  sum = cksum_update(sum, (uint16_t)(old >> 16), (uint16_t)(new >> 16));
+  return cksum_update(sum, (uint16_t)old, (uint16_t)new);
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
@@ -30,25 +30,32 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_snapshot.h"
+#include "sr_arena.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
 
 static void sr_log_packet(struct sr_instance* , uint8_t* , int );
+static void sr_tx_drain(struct sr_instance* );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
                                   unsigned int len,
-                                  char* interface  /* lent */);
+                                  struct sr_if* iface /* lent */);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
 
 /*-----------------------------------------------------------------------------
@@ -159,6 +166,13 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
         if(sr_read_from_server_expect(sr, VNS_RTABLE) != 1)
             return -1; /* needed to get the rtable */
 
+    /* -- from here on a slow server can't stall the router, see sr_egress.h -- */
+    if(fcntl(sr->sockfd, F_SETFL, fcntl(sr->sockfd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        perror("fcntl(..):sr_client.c::sr_connect_to_server()");
+        return -1;
+    }
+
     return 0;
 } /* -- sr_connect_to_server -- */
 
@@ -318,6 +332,108 @@ int sr_handle_auth_status(struct sr_instance* sr, c_auth_status* status) {
     return status->auth_ok;
 }
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_fill(..)
+ * Scope: Local
+ *
+ * One read from the server into the free end of the receive buffer.
+ * While it waits for the server it also drains the egress queues whenever
+ * the socket is writable.  Returns the bytes read, 0 if the server closed
+ * the connection, or -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_rx_fill(struct sr_instance* sr)
+{
+    struct pollfd fds[2];
+    char wake[16];
+    int ret;
+
+    for(;;)
+    {
+        fds[0].fd = sr->sockfd;
+        fds[0].events = POLLIN;
+        if(__atomic_load_n(&(sr->egress.backlog), __ATOMIC_RELAXED))
+        { fds[0].events |= POLLOUT; }
+        fds[1].fd = sr->tx_wake[0];
+        fds[1].events = POLLIN;
+
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR) /* be mindful of signals */
+            { continue; }
+            perror("poll(..):sr_vns_comm.c::sr_rx_fill");
+            return -1;
+        }
+
+        /* -- another thread left frames waiting, look out for POLLOUT -- */
+        if(fds[1].revents & POLLIN)
+        { while(read(sr->tx_wake[0], wake, sizeof(wake)) > 0); }
+
+        if(fds[0].revents & POLLOUT)
+        {
+            pthread_mutex_lock(&(sr->send_lock));
+            sr_tx_drain(sr);
+            pthread_mutex_unlock(&(sr->send_lock));
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ret = read(sr->sockfd, sr->rx_buf + sr->rx_end,
+                       SR_RX_BUF - sr->rx_end);
+            if(ret >= 0 || (errno != EINTR && errno != EAGAIN &&
+                            errno != EWOULDBLOCK))
+            { break; }
+        }
+    }
+
+    if (ret == -1)
+    {
+        perror("read(..):sr_vns_comm.c::sr_rx_fill");
+        return -1;
+    }
+
+    sr->rx_end += ret;
+    sr->rx_reads++;
+    return ret;
+} /* -- sr_rx_fill -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_next(..)
+ * Scope: Local
+ *
+ * The next complete command in the receive buffer, consumed, with its
+ * length in *len.  0 with *len 0 if it hasn't all arrived yet, 0 with
+ * *len -1 if its length is impossible.
+ *
+ *---------------------------------------------------------------------------*/
+
+static uint8_t* sr_rx_next(struct sr_instance* sr, int* len)
+{
+    uint8_t* buf = sr->rx_buf + sr->rx_start;
+    uint32_t nlen;
+
+    *len = 0;
+    if (sr->rx_end - sr->rx_start < sizeof(uint32_t))
+    { return 0; }
+
+    memcpy(&nlen, buf, sizeof(uint32_t));
+    nlen = ntohl(nlen);
+    if ( nlen > SR_VNS_CMD_MAX || nlen < sizeof(c_base) )
+    {
+        fprintf(stderr,"Error: command length to large %u\n",nlen);
+        *len = -1;
+        return 0;
+    }
+
+    if (sr->rx_end - sr->rx_start < nlen)
+    { return 0; }
+
+    sr->rx_start += nlen;
+    *len = nlen;
+    return buf;
+} /* -- sr_rx_next -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_read_from_server(..)
  * Scope: global
@@ -331,180 +447,218 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
     return sr_read_from_server_expect(sr, 0);
 }
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_from_server_expect(..)
+ * Scope: global
+ *
+ * Reads from the server in chunks of up to SR_RX_BUF bytes and handles
+ * every complete command that came in; a read costs one system call for
+ * however many commands it brings.  Packets are handed to the router in
+ * batches of up to SR_RX_BATCH, straight from the receive buffer, in the
+ * order they arrived relative to the other commands.  Whatever is left of
+ * a partial command is kept for the next call.  If expected_cmd is set
+ * only one command is handled, and it must be that one.
+ *
+ * Returns 1 to go on, 0 if the server closed the session, -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
 {
+    struct sr_frame batch[SR_RX_BATCH];
+    int nbatch = 0;
     int command, len;
     unsigned char *buf = 0;
     c_packet_ethernet_header* sr_pkt = 0;
-    int ret = 0, bytes_read = 0;
+    struct sr_if* iface = 0;
+    struct sr_mbuf* m;
+    int ret = 1;
 
     /* REQUIRES */
     assert(sr);
 
-    /*---------------------------------------------------------------------------
-      Read a command from the server
-      -------------------------------------------------------------------------*/
-
-    bytes_read = 0;
-
-    /* attempt to read the size of the incoming packet */
-    while( bytes_read < 4)
+    if(sr->rx_mbuf == 0)
     {
-        do
-        { /* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-
-                perror("recv(..):sr_client.c::sr_read_from_server");
-                return -1;
-            }
-            bytes_read += ret;
-        } while ( errno == EINTR); /* be mindful of signals */
-
+        if((sr->rx_mbuf = sr_mbuf_get(&(sr->rx_pool))) == 0)
+        {
+            fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
+            return -1;
+        }
+        sr->rx_buf = sr->rx_mbuf->data;
     }
 
-    len = ntohl(len);
-
-    if ( len > 10000 || len < 0 )
-    {
-        fprintf(stderr,"Error: command length to large %d\n",len);
-        close(sr->sockfd);
-        return -1;
-    }
+    /*---------------------------------------------------------------------------
+      Read from the server, unless a whole command is waiting already
+      -------------------------------------------------------------------------*/
 
-    if((buf = malloc(len)) == 0)
+    while((buf = sr_rx_next(sr, &len)) == 0)
     {
-        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
-        return -1;
+        if(len == 0 && (ret = sr_rx_fill(sr)) == 0)
+        { fprintf(stderr,"Error: server closed the connection\n"); }
+        if(len != 0 || ret <= 0)
+        {
+            close(sr->sockfd);
+            return -1;
+        }
     }
+    ret = 1;
 
-    /* set first field of command since we've already read it */
-    *((int *)buf) = htonl(len);
-
-    bytes_read = 0;
-
-    /* read the rest of the command */
-    while ( bytes_read < len - 4)
+    for( ; buf; buf = (ret == 1 && !expected_cmd) ? sr_rx_next(sr, &len) : 0)
     {
-        do
-        {/* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
-                    -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-                fprintf(stderr,"Error: failed reading command body %d\n",ret);
-                close(sr->sockfd);
-                return -1;
+        /* My entry for most unreadable line of code - guido */
+        /* ... you win - mc                                  */
+        command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
+
+        /* make sure the command is what we expected if we were expecting something */
+        if(expected_cmd && command!=expected_cmd) {
+            if(command != VNSCLOSE) { /* VNSCLOSE is always ok */
+                fprintf(stderr, "Error: expected command %d but got %d\n", expected_cmd, command);
+                ret = -1;
+                break;
             }
-            bytes_read += ret;
-        } while (errno == EINTR); /* be mindful of signals */
-    }
-
-    /* My entry for most unreadable line of code - guido */
-    /* ... you win - mc                                  */
-    command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
-
-    /* make sure the command is what we expected if we were expecting something */
-    if(expected_cmd && command!=expected_cmd) {
-        if(command != VNSCLOSE) { /* VNSCLOSE is always ok */
-            fprintf(stderr, "Error: expected command %d but got %d\n", expected_cmd, command);
-            return -1;
         }
-    }
 
-    ret = 1;
-    switch (command)
-    {
         /* -------------        VNSPACKET     -------------------- */
 
-        case VNSPACKET:
+        if(command == VNSPACKET)
+        {
             sr_pkt = (c_packet_ethernet_header *)buf;
 
+            /* -- the only name lookup a packet gets, past here it's the
+             *    interface's number -- */
+            sr_pkt->mInterfaceName[sizeof(sr_pkt->mInterfaceName) - 1] = 0;
+            if ( (iface = sr_get_interface(sr, sr_pkt->mInterfaceName)) == 0 )
+            {
+                fprintf(stderr,"Packet on unknown interface %s\n",
+                        sr_pkt->mInterfaceName);
+                continue;
+            }
+
             /* -- check if it is an ARP to another router if so drop   -- */
             if ( sr_arp_req_not_for_us(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
+                    iface) )
+            { continue; }
 
             /* -- log packet -- */
             sr_log_packet(sr, buf + sizeof(c_packet_header),
                     ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
 
-            /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+            /* -- batch for the router, student's code takes over there -- */
+            batch[nbatch].buf = buf + sizeof(c_packet_header);
+            batch[nbatch].len = len - sizeof(c_packet_ethernet_header) +
+                                sizeof(struct sr_ethernet_hdr);
+            batch[nbatch].ifid = iface->id;
+            sr->rx_frames++;
+            if(++nbatch == SR_RX_BATCH)
+            {
+                sr_handlepackets(sr, batch, nbatch);
+                nbatch = 0;
+            }
+            continue;
+        }
 
-            break;
+        /* -- everything else happens after the packets before it -- */
+        if(nbatch)
+        {
+            sr_handlepackets(sr, batch, nbatch);
+            nbatch = 0;
+        }
 
-            /* -------------        VNSCLOSE      -------------------- */
+        switch (command)
+        {
+                /* -------------        VNSCLOSE      -------------------- */
 
-        case VNSCLOSE:
-            fprintf(stderr,"VNS server closed session.\n");
-            fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
-            sr_session_closed_help();
+            case VNSCLOSE:
+                fprintf(stderr,"VNS server closed session.\n");
+                fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
+                sr_session_closed_help();
+                ret = 0;
+                break;
 
-            if(buf)
-            { free(buf); }
-            return 0;
-            break;
+                /* -------------        VNSBANNER      -------------------- */
 
-            /* -------------        VNSBANNER      -------------------- */
+            case VNSBANNER:
+                fprintf(stderr,"%s",((c_banner*)buf)->mBannerMessage);
+                break;
 
-        case VNSBANNER:
-            fprintf(stderr,"%s",((c_banner*)buf)->mBannerMessage);
-            break;
+                /* -------------     VNSHWINFO     -------------------- */
+
+            case VNSHWINFO:
+                sr_handle_hwinfo(sr,(c_hwinfo*)buf);
+                if(sr_verify_routing_table(sr) != 0)
+                {
+                    fprintf(stderr,"Routing table not consistent with hardware\n");
+                    ret = -1;
+                    break;
+                }
+                /* -- neighbors need their interfaces to be known -- */
+                sr_snapshot_restore_arp(sr);
+                sr_arena_report();
+                printf(" <-- Ready to process packets --> \n");
+                break;
 
-            /* -------------     VNSHWINFO     -------------------- */
+                /* ---------------- VNS_RTABLE ---------------- */
+            case VNS_RTABLE:
+                if(!sr_handle_rtable(sr, (c_rtable*)buf))
+                    ret = -1;
+                break;
 
-        case VNSHWINFO:
-            sr_handle_hwinfo(sr,(c_hwinfo*)buf);
-            if(sr_verify_routing_table(sr) != 0)
-            {
-                fprintf(stderr,"Routing table not consistent with hardware\n");
-                return -1;
-            }
-            printf(" <-- Ready to process packets --> \n");
-            break;
+                /* ------------- VNS_AUTH_REQUEST ------------- */
+            case VNS_AUTH_REQUEST:
+                if(!sr_handle_auth_request(sr, (c_auth_request*)buf))
+                    ret = -1;
+                break;
 
-            /* ---------------- VNS_RTABLE ---------------- */
-        case VNS_RTABLE:
-            if(!sr_handle_rtable(sr, (c_rtable*)buf))
-                ret = -1;
-            break;
+                /* ------------- VNS_AUTH_STATUS -------------- */
+            case VNS_AUTH_STATUS:
+                if(!sr_handle_auth_status(sr, (c_auth_status*)buf))
+                    ret = -1;
+                break;
 
-            /* ------------- VNS_AUTH_REQUEST ------------- */
-        case VNS_AUTH_REQUEST:
-            if(!sr_handle_auth_request(sr, (c_auth_request*)buf))
-                ret = -1;
-            break;
+            default:
+                Debug("unknown command: %d\n", command);
+                break;
 
-            /* ------------- VNS_AUTH_STATUS -------------- */
-        case VNS_AUTH_STATUS:
-            if(!sr_handle_auth_status(sr, (c_auth_status*)buf))
-                ret = -1;
-            break;
+        }/* -- switch -- */
+    }/* -- for -- */
 
-        default:
-            Debug("unknown command: %d\n", command);
-            break;
+    if(nbatch)
+    { sr_handlepackets(sr, batch, nbatch); }
 
-    }/* -- switch -- */
+    /* -- keep the partial command at the front for the next read, in a
+     *    fresh buffer if packets in this one are still held somewhere -- */
+    if(sr_mbuf_shared(sr->rx_mbuf) && (m = sr_mbuf_get(&(sr->rx_pool))) != 0)
+    {
+        memcpy(m->data, sr->rx_buf + sr->rx_start, sr->rx_end - sr->rx_start);
+        sr_mbuf_put(sr->rx_mbuf);
+        sr->rx_mbuf = m;
+        sr->rx_buf = m->data;
+    }
+    else if(sr_mbuf_shared(sr->rx_mbuf))
+    {
+        /* -- the stream can't go on without the partial command -- */
+        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
+        close(sr->sockfd);
+        return -1;
+    }
+    else
+    {
+        memmove(sr->rx_buf, sr->rx_buf + sr->rx_start,
+                sr->rx_end - sr->rx_start);
+    }
+    sr->rx_end -= sr->rx_start;
+    sr->rx_start = 0;
 
-    if(buf)
-    { free(buf); }
+    if(len < 0)
+    {
+        close(sr->sockfd);
+        return -1;
+    }
     return ret;
-}/* -- sr_read_from_server -- */
+}/* -- sr_read_from_server_expect -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
@@ -517,7 +671,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 static int
 sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
                                 uint8_t* buf, /* borrowed */
-                                const char* name /* borrowed */ )
+                                int id )
 {
     struct sr_ethernet_hdr* ether_hdr = 0;
     struct sr_if* iface = 0;
@@ -525,13 +679,12 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
     /* -- REQUIRES -- */
     assert(sr);
     assert(buf);
-    assert(name);
 
     ether_hdr = (struct sr_ethernet_hdr*)buf;
-    iface = sr_get_interface(sr, name);
+    iface = sr_get_interface_id(sr, id);
 
     if ( iface == 0 ){
-        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
+        fprintf( stderr, "** Error, interface %d, does not exist\n", id);
         return 0;
     }
 
@@ -550,6 +703,158 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
 
 } /* -- sr_ether_addrs_match_interface -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_tx_drain(..)
+ * Scope: Local
+ *
+ * Writes what the socket takes of the frames waiting in the egress
+ * queues.  Caller holds send_lock.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_tx_drain(struct sr_instance* sr)
+{
+    int done;
+
+    if(sr->egress.backlog == 0)
+    { return; }
+
+    if((done = sr_egress_drain(&(sr->egress), sr->sockfd)) > 0)
+    {
+        sr->txq.frames += done;
+        sr->txq.writes++;
+    }
+} /* -- sr_tx_drain -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_txq_flush(..)
+ * Scope: Local
+ *
+ * Writes every queued frame to the server in one writev and empties the
+ * queue.  Frames the socket doesn't take, and every frame while others
+ * are still waiting for it, move to the egress queues.  Caller
+ * holds send_lock.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_txq_flush(struct sr_instance* sr)
+{
+    struct sr_txq* q = &(sr->txq);
+    ssize_t written = 0;
+    size_t len;
+    uint32_t backlog;
+    int i, ret = 0;
+
+    if(q->n == 0)
+    { return 0; }
+
+    /* -- frames already waiting go first -- */
+    sr_tx_drain(sr);
+    backlog = sr->egress.backlog;
+
+    if(backlog == 0)
+    {
+        do
+        {
+            written = writev(sr->sockfd, q->iov, 2 * q->n);
+        } while (written < 0 && errno == EINTR);
+
+        if(written < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("writev(..):sr_vns_comm.c::sr_txq_flush");
+            q->n = 0;
+            q->bytes = 0;
+            return -1;
+        }
+        if(written < 0)
+        { written = 0; }
+        q->writes++;
+    }
+
+    for(i = 0; i < q->n; i++)
+    {
+        len = q->iov[2 * i].iov_len + q->iov[2 * i + 1].iov_len;
+        if((size_t)written >= len)
+        {
+            written -= len;
+            q->frames++;
+            continue;
+        }
+        if(sr_egress_put(&(sr->egress), q->ifid[i],
+                         sr->if_table[q->ifid[i]]->name, &(q->iov[2 * i]),
+                         written, q->mbuf[i]) < 0)
+        { ret = -1; }
+        written = 0;
+    }
+
+    /* -- the reader may be waiting on input alone, have it watch for POLLOUT -- */
+    if(backlog == 0 && sr->egress.backlog != 0 && sr->tx_wake[1] >= 0)
+    { (void)write(sr->tx_wake[1], "", 1); }
+
+    q->n = 0;
+    q->bytes = 0;
+    return ret;
+} /* -- sr_txq_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_txq_add(..)
+ * Scope: Local
+ *
+ * Checks a frame and puts it on the transmit queue behind its VNS header,
+ * writing out the queue first if it is full.  The frame itself isn't
+ * copied.  Returns 0 if the frame was queued.  Caller holds send_lock.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_txq_add(struct sr_instance* sr,
+                      uint8_t* buf /* borrowed */,
+                      unsigned int len,
+                      int id,
+                      struct sr_mbuf* mbuf /* borrowed */)
+{
+    struct sr_txq* q = &(sr->txq);
+    struct sr_if* iface;
+    c_packet_header* hdr;
+
+    if ( (iface = sr_get_interface_id(sr, id)) == 0 ){
+        fprintf(stderr, "** Error, interface %d, does not exist\n", id);
+        return -1;
+    }
+
+    /* don't waste my time ... */
+    if ( len < sizeof(struct sr_ethernet_hdr) ){
+        fprintf(stderr , "** Error: packet is wayy to short \n");
+        return -1;
+    }
+
+    /* -- log packet -- */
+    sr_log_packet(sr,buf,len);
+
+    if ( ! sr_ether_addrs_match_interface( sr, buf, id) ){
+        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        return -1;
+    }
+
+    if(q->n == SR_TXQ_MAX)
+    { sr_txq_flush(sr); }
+
+    hdr = &(q->hdrs[q->n]);
+    hdr->mLen  = htonl(len + sizeof(c_packet_header));
+    hdr->mType = htonl(VNSPACKET);
+    strncpy(hdr->mInterfaceName, iface->name, sizeof(hdr->mInterfaceName));
+
+    q->iov[2 * q->n].iov_base     = hdr;
+    q->iov[2 * q->n].iov_len      = sizeof(c_packet_header);
+    q->iov[2 * q->n + 1].iov_base = buf;
+    q->iov[2 * q->n + 1].iov_len  = len;
+    q->ifid[q->n] = id;
+    q->mbuf[q->n] = mbuf;
+    q->bytes += sizeof(c_packet_header) + len;
+    q->n++;
+
+    return 0;
+} /* -- sr_txq_add -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_send_packet(..)
  * Scope: Global
@@ -564,49 +869,136 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
-    c_packet_header *sr_pkt;
-    unsigned int total_len =  len + (sizeof(c_packet_header));
+    /* REQUIRES */
+    assert(iface);
+
+    return sr_send_packet_id(sr, buf, len, sr_interface_id(sr, iface));
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet_id(..)
+ * Scope: Global
+ *
+ * sr_send_packet(..) out of the interface numbered id.  Anything already
+ * queued goes out first, in the same write.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet_id(struct sr_instance* sr /* borrowed */,
+                      uint8_t* buf /* borrowed */ ,
+                      unsigned int len,
+                      int id)
+{
+    int ret;
 
     /* REQUIRES */
     assert(sr);
     assert(buf);
-    assert(iface);
 
-    /* don't waste my time ... */
-    if ( len < sizeof(struct sr_ethernet_hdr) ){
-        fprintf(stderr , "** Error: packet is wayy to short \n");
-        return -1;
-    }
+    /* -- the ARP cache's thread sends too, keep frames and log whole -- */
+    pthread_mutex_lock(&(sr->send_lock));
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
+    if( (ret = sr_txq_add(sr, buf, len, id, 0)) == 0 )
+    { ret = sr_txq_flush(sr); }
 
-    /* -- log packet -- */
-    sr_log_packet(sr,buf,len);
+    pthread_mutex_unlock(&(sr->send_lock));
 
-    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
-        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
-        return -1;
-    }
+    return ret;
+} /* -- sr_send_packet_id -- */
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
-        fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
-        return -1;
+/*-----------------------------------------------------------------------------
+ * Method: sr_queue_packet_id(..)
+ * Scope: Global
+ *
+ * sr_send_packet_id(..), but the frame may wait on the transmit queue to
+ * go out with others in one write.  buf stays borrowed until then, so it
+ * has to outlive the batch being handled; sr_handlepackets(..) calls
+ * sr_flush_packets(..) when it's done.  mbuf is the buffer buf is in, if
+ * there is one, so the frame can wait for the server without a copy.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_queue_packet_id(struct sr_instance* sr /* borrowed */,
+                       uint8_t* buf /* borrowed */ ,
+                       unsigned int len,
+                       int id,
+                       struct sr_mbuf* mbuf /* borrowed */)
+{
+    struct sr_txq* q = &(sr->txq);
+    int ret;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(buf);
+
+    pthread_mutex_lock(&(sr->send_lock));
+
+    if( (ret = sr_txq_add(sr, buf, len, id, mbuf)) == 0 &&
+        (q->n >= q->max_frames || q->bytes >= q->max_bytes) )
+    { ret = sr_txq_flush(sr); }
+
+    pthread_mutex_unlock(&(sr->send_lock));
+
+    return ret;
+} /* -- sr_queue_packet_id -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_flush_packets(..)
+ * Scope: Global
+ *
+ * Writes out whatever sr_queue_packet_id(..) left on the transmit queue
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_flush_packets(struct sr_instance* sr /* borrowed */)
+{
+    int ret;
+
+    /* REQUIRES */
+    assert(sr);
+
+    pthread_mutex_lock(&(sr->send_lock));
+    ret = sr_txq_flush(sr);
+    pthread_mutex_unlock(&(sr->send_lock));
+
+    return ret;
+} /* -- sr_flush_packets -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet_list(..)
+ * Scope: Global
+ *
+ * Send every packet on a list, in list order, each out of its own
+ * interface.  They go through the transmit queue, so up to SR_TXQ_MAX
+ * go to the server in a single write.  Packets that fail the checks in
+ * sr_send_packet(..) are skipped.  Returns the number sent, or -1 if a
+ * write failed.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet_list(struct sr_instance* sr /* borrowed */,
+                        struct sr_packet* pkts /* borrowed */)
+{
+    struct sr_packet* pkt;
+    int sent = 0;
+
+    /* REQUIRES */
+    assert(sr);
+
+    pthread_mutex_lock(&(sr->send_lock));
+
+    for(pkt = pkts; pkt; pkt = pkt->next)
+    {
+        if( sr_txq_add(sr, pkt->buf, pkt->len, pkt->ifid, pkt->mbuf) == 0 )
+        { sent++; }
     }
+    if( sr_txq_flush(sr) < 0 )
+    { sent = -1; }
 
-    free(sr_pkt);
+    pthread_mutex_unlock(&(sr->send_lock));
 
-    return 0;
-} /* -- sr_send_packet -- */
+    return sent;
+} /* -- sr_send_packet_list -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
@@ -644,9 +1036,8 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
 int  sr_arp_req_not_for_us(struct sr_instance* sr,
                            uint8_t * packet /* lent */,
                            unsigned int len,
-                           char* interface  /* lent */)
+                           struct sr_if* iface /* lent */)
 {
-    struct sr_if* iface = sr_get_interface(sr, interface);
     struct sr_ethernet_hdr* e_hdr = 0;
     struct sr_arp_hdr*       a_hdr = 0;
 
@@ -658,9 +1049,11 @@ int  sr_arp_req_not_for_us(struct sr_instance* sr,
     e_hdr = (struct sr_ethernet_hdr*)packet;
     a_hdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
 
+    /* -- gratuitous ARP (sender asks for itself) goes through if wanted -- */
     if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
             (a_hdr->ar_op      == htons(arp_op_request))   &&
-            (a_hdr->ar_tip     != iface->ip ) )
+            (a_hdr->ar_tip     != iface->ip ) &&
+            !(sr->arp_garp && a_hdr->ar_sip == a_hdr->ar_tip) )
     { return 1; }
 
     return 0;